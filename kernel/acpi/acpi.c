@@ -0,0 +1,144 @@
+#include "acpi.h"
+#include "boot/boot_info.h"
+#include "pmm.h"
+#include <stddef.h>
+
+typedef struct acpi_rsdp {
+        char signature[8];
+        uint8_t checksum;
+        char oem_id[6];
+        uint8_t revision;
+        uint32_t rsdt_address;
+        /* revision >= 2 */
+        uint32_t length;
+        uint64_t xsdt_address;
+        uint8_t ext_checksum;
+        uint8_t reserved[3];
+} __attribute__((packed)) acpi_rsdp_t;
+
+#define ACPI_RSDP_V1_LEN 20u
+
+/* FADT fields by offset; the table grew over revisions */
+#define FADT_PM_TMR_BLK 76u
+#define FADT_PM_TMR_LEN 91u
+#define FADT_FLAGS 112u
+#define FADT_X_PM_TMR_BLK 208u
+#define FADT_FLAG_TMR_VAL_EXT (1u << 8)
+
+static uint8_t g_revision;
+static const acpi_sdt_header_t *g_root; // XSDT, or RSDT if g_root_entry == 4
+static uint32_t g_root_entry;
+
+/*
+ * Tables live in ordinary RAM, already mapped write-back through the
+ * HHDM. A second, uncached mapping would conflict with it.
+ */
+static const void *acpi_map(uint64_t phys) {
+    return (const void *)phys_to_virt(phys);
+}
+
+static int acpi_checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = (const uint8_t *)p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; i++)
+        sum = (uint8_t)(sum + b[i]);
+    return sum == 0;
+}
+
+static int sig_eq(const char *a, const char *b, uint32_t n) {
+    for (uint32_t i = 0; i < n; i++) {
+        if (a[i] != b[i])
+            return 0;
+    }
+    return 1;
+}
+
+/* a table given its header's physical address, 0 if it looks truncated */
+static const acpi_sdt_header_t *acpi_map_table(uint64_t phys) {
+    if (!phys)
+        return 0;
+    const acpi_sdt_header_t *h = (const acpi_sdt_header_t *)acpi_map(phys);
+    if (h->length < sizeof(*h))
+        return 0;
+    return h;
+}
+
+int acpi_init(void) {
+    uint64_t rsdp_phys = g_boot_info.acpi.address;
+    if (!rsdp_phys)
+        return -1;
+
+    const acpi_rsdp_t *rsdp = (const acpi_rsdp_t *)acpi_map(rsdp_phys);
+    if (!sig_eq(rsdp->signature, "RSD PTR ", 8) ||
+        !acpi_checksum_ok(rsdp, ACPI_RSDP_V1_LEN))
+        return -1;
+
+    g_revision = rsdp->revision;
+    uint64_t root_phys;
+    if (rsdp->revision >= 2 && rsdp->xsdt_address &&
+        acpi_checksum_ok(rsdp, rsdp->length)) {
+        root_phys = rsdp->xsdt_address;
+        g_root_entry = 8;
+    } else {
+        root_phys = rsdp->rsdt_address;
+        g_root_entry = 4;
+    }
+
+    const acpi_sdt_header_t *root = acpi_map_table(root_phys);
+    if (!root || !acpi_checksum_ok(root, root->length))
+        return -1;
+    g_root = root;
+    return 0;
+}
+
+uint8_t acpi_revision(void) { return g_revision; }
+
+const acpi_sdt_header_t *acpi_find_table(const char *sig) {
+    const acpi_sdt_header_t *root = g_root;
+    if (!root)
+        return 0;
+
+    const uint8_t *entries = (const uint8_t *)(root + 1);
+    uint32_t n = (root->length - (uint32_t)sizeof(*root)) / g_root_entry;
+
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t phys;
+        if (g_root_entry == 8)
+            phys = *(const uint64_t *)(entries + i * 8);
+        else
+            phys = *(const uint32_t *)(entries + i * 4);
+
+        const acpi_sdt_header_t *h = acpi_map_table(phys);
+        if (h && sig_eq(h->signature, sig, 4) &&
+            acpi_checksum_ok(h, h->length))
+            return h;
+    }
+    return 0;
+}
+
+int acpi_pm_timer(uint16_t *port, uint32_t *bits) {
+    const acpi_sdt_header_t *fadt = acpi_find_table("FACP");
+    if (!fadt || fadt->length < FADT_FLAGS + 4)
+        return -1;
+
+    const uint8_t *f = (const uint8_t *)fadt;
+    uint64_t addr = 0;
+
+    if (fadt->length >= FADT_X_PM_TMR_BLK + sizeof(acpi_gas_t)) {
+        const acpi_gas_t *x = (const acpi_gas_t *)(f + FADT_X_PM_TMR_BLK);
+        if (x->address) {
+            if (x->space_id != ACPI_GAS_IO)
+                return -1;
+            addr = x->address;
+        }
+    }
+    if (!addr && f[FADT_PM_TMR_LEN] >= 4)
+        addr = *(const uint32_t *)(f + FADT_PM_TMR_BLK);
+    if (!addr || addr > 0xffff)
+        return -1;
+
+    uint32_t flags = *(const uint32_t *)(f + FADT_FLAGS);
+    *port = (uint16_t)addr;
+    *bits = (flags & FADT_FLAG_TMR_VAL_EXT) ? 32 : 24;
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+/* just enough ACPI to find the fixed hardware the kernel uses */
+
+typedef struct acpi_sdt_header {
+        char signature[4];
+        uint32_t length;
+        uint8_t revision;
+        uint8_t checksum;
+        char oem_id[6];
+        char oem_table_id[8];
+        uint32_t oem_revision;
+        uint32_t creator_id;
+        uint32_t creator_revision;
+} __attribute__((packed)) acpi_sdt_header_t;
+
+/* generic address structure */
+typedef struct acpi_gas {
+        uint8_t space_id;
+        uint8_t bit_width;
+        uint8_t bit_offset;
+        uint8_t access_size;
+        uint64_t address;
+} __attribute__((packed)) acpi_gas_t;
+
+#define ACPI_GAS_MEMORY 0
+#define ACPI_GAS_IO 1
+
+typedef struct acpi_hpet {
+        acpi_sdt_header_t hdr;
+        uint32_t block_id;
+        acpi_gas_t base;
+        uint8_t number;
+        uint16_t min_tick;
+        uint8_t page_protection;
+} __attribute__((packed)) acpi_hpet_t;
+
+/* ACPI PM timer input clock */
+#define ACPI_PM_TIMER_HZ 3579545ull
+
+/* validate the RSDP handed over by the bootloader; -1 if there is none */
+int acpi_init(void);
+uint8_t acpi_revision(void);
+
+/* mapped table with the given signature and a valid checksum, or 0 */
+const acpi_sdt_header_t *acpi_find_table(const char *sig);
+
+/*
+ * I/O port of the PM timer from the FADT, and its width (24 or 32 bits).
+ * Returns -1 if there is none or it is not in I/O space.
+ */
+int acpi_pm_timer(uint16_t *port, uint32_t *bits);
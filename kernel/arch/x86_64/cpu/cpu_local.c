@@ -1,6 +1,29 @@
 #include "cpu_local.h"
+#include "msr.h"
+
+#define IA32_GS_BASE 0xc0000101u
+#define IA32_KERNEL_GS_BASE 0xc0000102u
 
 cpu_local_t g_cpu_local = {
     .kernel_rsp = 0,
     .user_rsp = 0,
+    .preempt_count = 0,
+    .need_resched = 0,
+    .irq_stack_top = 0,
 };
+
+cpu_local_t *g_cpus[MAX_CPUS];
+uint32_t g_nr_cpus;
+
+void cpu_local_init(cpu_local_t *cl, uint32_t cpu_id) {
+    cl->self = cl;
+    cl->cpu_id = cpu_id;
+
+    /* ring 0 always runs with the kernel base live; entry paths swapgs */
+    wrmsr(IA32_GS_BASE, (uint64_t)cl);
+    wrmsr(IA32_KERNEL_GS_BASE, 0);
+
+    g_cpus[cpu_id] = cl;
+    if (cpu_id >= g_nr_cpus)
+        g_nr_cpus = cpu_id + 1;
+}
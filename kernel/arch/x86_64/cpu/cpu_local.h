@@ -1,9 +1,45 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 
+#define MAX_CPUS 64
+
+/*
+ * Per-cpu block, reached through GS in ring 0. Offsets of the first
+ * fields are hard-coded in syscall_entry.S and isr.S.
+ */
 typedef struct cpu_local {
         uint64_t kernel_rsp;
         uint64_t user_rsp;
+        uint32_t preempt_count; // >0: curr must not be switched out
+        uint32_t need_resched;  // switch at the next preemption point
+        uint64_t irq_stack_top; // isr.S: irq handlers run here
+        struct cpu_local *self; // this_cpu() loads it through GS
+        uint32_t cpu_id;        // dense index, 0 = BSP
+        uint32_t apic_id;
 } cpu_local_t;
 
-extern cpu_local_t g_cpu_local;
+/* hard-coded below, in preempt.h and in the entry stubs */
+_Static_assert(offsetof(cpu_local_t, preempt_count) == 16, "cpu_local");
+_Static_assert(offsetof(cpu_local_t, need_resched) == 20, "cpu_local");
+_Static_assert(offsetof(cpu_local_t, irq_stack_top) == 24, "cpu_local");
+_Static_assert(offsetof(cpu_local_t, self) == 32, "cpu_local");
+
+extern cpu_local_t g_cpu_local; // the BSP's block
+extern cpu_local_t *g_cpus[MAX_CPUS];
+extern uint32_t g_nr_cpus; // online cpus, ids 0..g_nr_cpus-1
+
+/* load GS with cl and mark the cpu online; GS selector loads reset it */
+void cpu_local_init(cpu_local_t *cl, uint32_t cpu_id);
+
+static inline cpu_local_t *this_cpu(void) {
+    cpu_local_t *cl;
+    // volatile: the thread may have moved since any earlier load
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov %0, gs:[32]\n"
+                     ".att_syntax prefix\n"
+                     : "=r"(cl));
+    return cl;
+}
+
+static inline uint32_t this_cpu_id(void) { return this_cpu()->cpu_id; }
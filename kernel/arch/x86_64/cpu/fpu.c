@@ -0,0 +1,248 @@
+#include "fpu.h"
+#include "core/panic.h"
+#include "cpuid.h"
+#include "msr.h"
+#include "pmm.h"
+
+#define CR0_MP (1ull << 1)
+#define CR0_EM (1ull << 2)
+#define CR0_TS (1ull << 3)
+#define CR0_NE (1ull << 5)
+
+#define CR4_OSFXSR (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE (1ull << 18)
+
+#define XFEATURE_X87 (1ull << 0)
+#define XFEATURE_SSE (1ull << 1)
+#define XFEATURE_AVX (1ull << 2)
+#define XFEATURE_OPMASK (1ull << 5)
+#define XFEATURE_ZMM_HI256 (1ull << 6)
+#define XFEATURE_HI16_ZMM (1ull << 7)
+
+/* user state components we are prepared to context switch */
+#define XFEATURE_USER_MASK                                                     \
+    (XFEATURE_X87 | XFEATURE_SSE | XFEATURE_AVX | XFEATURE_OPMASK |            \
+     XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM)
+
+#define IA32_XSS 0xda0
+
+#define FXSAVE_FCW_OFFSET 0
+#define FXSAVE_MXCSR_OFFSET 24
+#define FCW_DEFAULT 0x037f
+#define MXCSR_DEFAULT 0x1f80
+
+#define XSAVE_HDR_OFFSET 512
+#define XCOMP_BV_COMPACTED (1ull << 63)
+
+#define FXSAVE_AREA_SIZE 512u
+
+static fpu_save_mode_t g_mode = FPU_SAVE_FXSAVE;
+static uint64_t g_xcr0 = 0;
+static size_t g_size = FXSAVE_AREA_SIZE;
+static int g_has_xinuse = 0;
+
+/* all-components-in-init-state image, used to scrub registers */
+static uint8_t g_init_area[4096] __attribute__((aligned(64)));
+
+static inline uint64_t xgetbv(uint32_t idx) {
+    uint32_t lo, hi;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "xgetbv\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(lo), "=d"(hi)
+                     : "c"(idx));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void xsetbv(uint32_t idx, uint64_t val) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "xsetbv\n"
+                     ".att_syntax prefix\n"
+                     :
+                     : "c"(idx), "a"((uint32_t)val), "d"((uint32_t)(val >> 32))
+                     : "memory");
+}
+
+static inline void fpu_save(void *area) {
+    uint32_t lo = (uint32_t)g_xcr0;
+    uint32_t hi = (uint32_t)(g_xcr0 >> 32);
+
+    switch (g_mode) {
+    case FPU_SAVE_XSAVES:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "xsaves64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "xsaveopt64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    case FPU_SAVE_XSAVE:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "xsave64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    default:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "fxsave64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area)
+                         : "memory");
+        break;
+    }
+}
+
+static inline void fpu_restore(const void *area) {
+    uint32_t lo = (uint32_t)g_xcr0;
+    uint32_t hi = (uint32_t)(g_xcr0 >> 32);
+
+    switch (g_mode) {
+    case FPU_SAVE_XSAVES:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "xrstors64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    case FPU_SAVE_XSAVEOPT:
+    case FPU_SAVE_XSAVE:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "xrstor64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area), "a"(lo), "d"(hi)
+                         : "memory");
+        break;
+    default:
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "fxrstor64 [rdi]\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "D"(area)
+                         : "memory");
+        break;
+    }
+}
+
+/*
+ * Components currently not in their init state. Without XGETBV(1) we have
+ * to assume everything is live.
+ */
+static inline uint64_t fpu_xinuse(void) {
+    if (!g_has_xinuse)
+        return 1;
+    return xgetbv(1) & g_xcr0;
+}
+
+static void *fpu_alloc_area(void) {
+    size_t pages = (g_size + 4095) / 4096;
+    void *phys = pmm_alloc_pages(pages);
+    if (!phys)
+        return 0;
+
+    uint8_t *area = (uint8_t *)phys_to_virt((uint64_t)phys);
+    for (size_t i = 0; i < pages * 4096; i++)
+        area[i] = 0;
+    return area;
+}
+
+void fpu_init(void) {
+    // legacy region defaults; XRSTOR takes MXCSR from here even when the
+    // SSE component is flagged as init
+    *(uint16_t *)(g_init_area + FXSAVE_FCW_OFFSET) = FCW_DEFAULT;
+    *(uint32_t *)(g_init_area + FXSAVE_MXCSR_OFFSET) = MXCSR_DEFAULT;
+
+    uint64_t cr0 = rdcr0();
+    cr0 &= ~(CR0_EM | CR0_TS);
+    cr0 |= CR0_MP | CR0_NE;
+    wrcr0(cr0);
+
+    uint64_t cr4 = rdcr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+
+    cpuid_regs_t r1 = cpuid(1, 0);
+    const int has_xsave = (r1.ecx >> 26) & 1u;
+
+    if (!has_xsave || cpuid_max_leaf() < 0xd) {
+        wrcr4(cr4);
+        g_mode = FPU_SAVE_FXSAVE;
+        g_size = FXSAVE_AREA_SIZE;
+        return;
+    }
+
+    wrcr4(cr4 | CR4_OSXSAVE);
+
+    cpuid_regs_t d0 = cpuid(0xd, 0);
+    uint64_t supported = ((uint64_t)d0.edx << 32) | d0.eax;
+    g_xcr0 = supported & XFEATURE_USER_MASK;
+
+    // AVX-512 components are only valid as a group
+    const uint64_t avx512 =
+        XFEATURE_OPMASK | XFEATURE_ZMM_HI256 | XFEATURE_HI16_ZMM;
+    if ((g_xcr0 & avx512) != avx512)
+        g_xcr0 &= ~avx512;
+    if (!(g_xcr0 & XFEATURE_AVX))
+        g_xcr0 &= ~avx512;
+
+    xsetbv(0, g_xcr0);
+
+    cpuid_regs_t d1 = cpuid(0xd, 1);
+    g_has_xinuse = (d1.eax >> 2) & 1u;
+
+    if ((d1.eax >> 3) & 1u) {
+        // XSAVES/XRSTORS: compacted format, supervisor states left off
+        wrmsr(IA32_XSS, 0);
+        g_mode = FPU_SAVE_XSAVES;
+        g_size = cpuid(0xd, 1).ebx;
+    } else {
+        g_mode = (d1.eax & 1u) ? FPU_SAVE_XSAVEOPT : FPU_SAVE_XSAVE;
+        // EBX reflects the size for the XCR0 just written
+        g_size = cpuid(0xd, 0).ebx;
+    }
+
+    if (g_size > sizeof(g_init_area))
+        panic("fpu: xsave area larger than init image");
+
+    uint64_t *hdr = (uint64_t *)(g_init_area + XSAVE_HDR_OFFSET);
+    hdr[0] = 0; // XSTATE_BV: everything in init state
+    hdr[1] = (g_mode == FPU_SAVE_XSAVES) ? (XCOMP_BV_COMPACTED | g_xcr0) : 0;
+}
+
+size_t fpu_state_size(void) { return g_size; }
+fpu_save_mode_t fpu_save_mode(void) { return g_mode; }
+
+void fpu_switch(fpu_ctx_t *prev, fpu_ctx_t *next) {
+    if (prev == next)
+        return;
+
+    const uint64_t inuse = fpu_xinuse();
+
+    if (inuse) {
+        if (!prev->area) {
+            prev->area = fpu_alloc_area();
+            if (!prev->area)
+                panic("fpu: out of memory for xsave area");
+        }
+        fpu_save(prev->area);
+        prev->used = 1;
+    } else {
+        prev->used = 0;
+    }
+
+    if (next->used)
+        fpu_restore(next->area);
+    else if (inuse)
+        fpu_restore(g_init_area); // don't leak prev's registers
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    FPU_SAVE_FXSAVE = 0,
+    FPU_SAVE_XSAVE,
+    FPU_SAVE_XSAVEOPT,
+    FPU_SAVE_XSAVES,
+} fpu_save_mode_t;
+
+/*
+ * Per-thread extended state. The area is allocated the first time the
+ * thread is switched out with live FPU/SSE/AVX state, so integer-only
+ * threads never pay for it.
+ */
+typedef struct fpu_ctx {
+        void *area;
+        uint8_t used; // area holds state that must be restored
+} fpu_ctx_t;
+
+void fpu_init(void);
+size_t fpu_state_size(void);
+fpu_save_mode_t fpu_save_mode(void);
+
+/* interrupts disabled; called by the scheduler before switch_to */
+void fpu_switch(fpu_ctx_t *prev, fpu_ctx_t *next);
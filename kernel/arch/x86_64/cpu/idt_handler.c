@@ -1,5 +1,6 @@
 #include "../core/panic.h"
 #include "../core/print.h"
+#include "kstack.h"
 #include "regs.h"
 #include <stdint.h>
 
@@ -44,6 +45,8 @@ void isr_common_handler(isr_frame_t *f) {
         uint64_t cr2 = read_cr2();
         kprint(" cr2=");
         kprint_hex_u64(cr2);
+        if (kstack_is_guard(cr2))
+            kprint(" (kernel stack overflow)");
     }
 
     panic("unhandled exception");
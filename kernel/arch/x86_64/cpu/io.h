@@ -19,4 +19,14 @@ static inline uint8_t inb(uint16_t port) {
     return val;
 }
 
+static inline uint32_t inl(uint16_t port) {
+    uint32_t val;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "in eax, dx\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(val)
+                     : "d"(port));
+    return val;
+}
+
 static inline void io_wait(void) { outb(0x80, 0); }
@@ -22,20 +22,26 @@ void irq_register_vector_handler(uint8_t vector, irq_handler_t handler) {
     g_vector_handlers[vector] = handler;
 }
 
+/*
+ * Runs on the per-cpu irq stack. EOI goes out before the handler runs:
+ * the preemption point in irq_common may switch threads and only come
+ * back much later. IF stays clear until iretq, so nothing can nest in the
+ * meantime.
+ */
 void irq_common_handler(isr_frame_t *f) {
     uint8_t vec = (uint8_t)f->vector;
 
     if (vec >= IRQ_BASE && vec < IRQ_BASE + 16) {
         uint8_t irq = (uint8_t)(vec - IRQ_BASE);
+        pic_send_eoi(irq);
         if (g_handlers[irq])
             g_handlers[irq](f);
-        pic_send_eoi(irq);
         return;
     }
 
-    if (g_vector_handlers[vec])
-        g_vector_handlers[vec](f);
-
     if (lapic_is_enabled() && vec != LAPIC_SPURIOUS_VECTOR)
         lapic_eoi();
+
+    if (g_vector_handlers[vec])
+        g_vector_handlers[vec](f);
 }
@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+
+#define RFLAGS_IF (1ull << 9)
+
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "pushfq\n"
+                     "pop rax\n"
+                     "cli\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(flags)
+                     :
+                     : "memory");
+    return flags;
+}
+
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF)
+        __asm__ volatile("sti" ::: "memory");
+}
+
+static inline void cpu_irq_disable(void) {
+    __asm__ volatile("cli" ::: "memory");
+}
+
+static inline void cpu_irq_enable(void) {
+    __asm__ volatile("sti" ::: "memory");
+}
+
+/* let pending interrupts in, then mask again */
+static inline void cpu_irq_window(void) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "sti\n"
+                     "nop\n"
+                     "cli\n"
+                     ".att_syntax prefix\n"
+                     :
+                     :
+                     : "memory");
+}
+
+static inline int cpu_irq_enabled(void) {
+    uint64_t flags;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "pushfq\n"
+                     "pop rax\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(flags)
+                     :
+                     : "memory");
+    return (flags & RFLAGS_IF) != 0;
+}
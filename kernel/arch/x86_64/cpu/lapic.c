@@ -1,19 +1,28 @@
 #include "lapic.h"
+#include "cpuid.h"
 #include "mmio.h"
 #include "msr.h"
 #include "pit.h"
 #include "relax.h"
 #include "tsc.h"
-#include <emmintrin.h>
 #include <stdint.h>
 
 #define IA32_APIC_BASE 0x1b
 #define IA32_APIC_BASE_ENABLE (1u << 11)
 #define IA32_APIC_BASE_X2APIC (1u << 10)
 
+/* x2APIC registers are MSRs at 0x800 + (xAPIC offset >> 4) */
+#define X2APIC_MSR_BASE 0x800u
+#define X2APIC_MSR_ICR 0x830u
+
+#define CPUID_1_ECX_X2APIC (1u << 21)
+
+#define LAPIC_REG_ID 0x20
 #define LAPIC_REG_TPR 0x80
 #define LAPIC_REG_EOI 0xb0
 #define LAPIC_REG_SVR 0xf0
+#define LAPIC_REG_ICR_LO 0x300
+#define LAPIC_REG_ICR_HI 0x310
 #define LAPIC_REG_LVT_TIMER 0x320
 #define LAPIC_REG_TMR_INITCNT 0x380
 #define LAPIC_REG_TMR_CURRCNT 0x390
@@ -22,53 +31,97 @@
 #define LAPIC_SVR_ENABLE (1u << 8)
 #define LAPIC_LVT_MASK (1u << 16)
 #define LAPIC_LVT_TSC_DEADLINE (1u << 18)
+#define LAPIC_ICR_PENDING (1u << 12)
 
 #define LAPIC_TIMER_DIV_16 0x3
 
-// static volatile uint32_t *g_lapic = 0;
 static uint8_t g_timer_vector = 0;
 static uintptr_t g_lapic_base = 0;
+static lapic_mode_t g_mode = LAPIC_MODE_NONE;
 
+/*
+ * x2APIC: one WRMSR per access instead of an uncached MMIO round trip.
+ * The mode never changes after lapic_init(), so the branch predicts.
+ */
 static inline void lapic_write(uint32_t reg, uint32_t val) {
-    // *(volatile uint32_t *)((uintptr_t)g_lapic + reg) = val;
-    // (void)*(volatile uint32_t *)((uintptr_t)g_lapic + reg);
-    mmio_write32(g_lapic_base, reg, val);
+    if (g_mode == LAPIC_MODE_X2APIC)
+        wrmsr(X2APIC_MSR_BASE + (reg >> 4), val);
+    else
+        mmio_write32(g_lapic_base, reg, val);
 }
 
 static inline uint32_t lapic_read(uint32_t reg) {
-    // return *(volatile uint32_t *)((uintptr_t)g_lapic + reg);
+    if (g_mode == LAPIC_MODE_X2APIC)
+        return (uint32_t)rdmsr(X2APIC_MSR_BASE + (reg >> 4));
     return mmio_read32(g_lapic_base, reg);
 }
 
-int lapic_is_enabled(void) {
-    return (rdmsr(IA32_APIC_BASE) & IA32_APIC_BASE_ENABLE) != 0;
+int lapic_is_enabled(void) { return g_mode != LAPIC_MODE_NONE; }
+lapic_mode_t lapic_mode(void) { return g_mode; }
+
+static int cpu_has_x2apic(void) {
+    return (cpuid(1, 0).ecx & CPUID_1_ECX_X2APIC) != 0;
 }
 
+/*
+ * Prefer x2APIC; firmware may already have switched to it (required once
+ * APIC IDs exceed 255), and going back to xAPIC is not a legal
+ * transition anyway.
+ */
 void lapic_init(void) {
     uint64_t base = rdmsr(IA32_APIC_BASE);
-    base &= ~IA32_APIC_BASE_X2APIC;
     base |= IA32_APIC_BASE_ENABLE;
-    wrmsr(IA32_APIC_BASE, base);
-
-    uint64_t phys = base & 0xfffff000ull;
-    // g_lapic = (volatile uint32_t *)phys_to_virt(phys);
 
-    if (!g_lapic_base) {
-        mmio_opts_t o = {
-            .cache = MMIO_CACHE_UC, .writable = 1, .global = 1, .nx = 1};
-        g_lapic_base = mmio_map((uintptr_t)phys, 0x1000, &o);
+    if ((base & IA32_APIC_BASE_X2APIC) || cpu_has_x2apic()) {
+        // xAPIC enabled first, then x2APIC: the only legal order
+        wrmsr(IA32_APIC_BASE, base);
+        wrmsr(IA32_APIC_BASE, base | IA32_APIC_BASE_X2APIC);
+        g_mode = LAPIC_MODE_X2APIC;
+    } else {
+        wrmsr(IA32_APIC_BASE, base);
+
+        uint64_t phys = base & 0xfffff000ull;
+        if (!g_lapic_base) {
+            mmio_opts_t o = {
+                .cache = MMIO_CACHE_UC, .writable = 1, .global = 1, .nx = 1};
+            g_lapic_base = mmio_map((uintptr_t)phys, 0x1000, &o);
+        }
+        g_mode = LAPIC_MODE_XAPIC;
     }
+
     lapic_write(LAPIC_REG_TPR, 0);
     lapic_write(LAPIC_REG_SVR, LAPIC_SPURIOUS_VECTOR | LAPIC_SVR_ENABLE);
 }
 
+/* full 32-bit ID in x2APIC mode, 8 bits otherwise */
+uint32_t lapic_id(void) {
+    uint32_t id = lapic_read(LAPIC_REG_ID);
+    return g_mode == LAPIC_MODE_X2APIC ? id : id >> 24;
+}
+
 void lapic_eoi(void) {
-    // if (!g_lapic)
-    if (!g_lapic_base)
+    if (g_mode == LAPIC_MODE_NONE)
         return;
     lapic_write(LAPIC_REG_EOI, 0);
 }
 
+/* fixed delivery, physical destination */
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    if (g_mode == LAPIC_MODE_X2APIC) {
+        // WRMSR to the ICR is not serializing: make the stores the
+        // target is about to look at visible before the IPI lands
+        __asm__ volatile("mfence; lfence" ::: "memory");
+        wrmsr(X2APIC_MSR_ICR, ((uint64_t)apic_id << 32) | vector);
+        return;
+    }
+    if (g_mode == LAPIC_MODE_NONE || apic_id > 0xff)
+        return;
+    while (lapic_read(LAPIC_REG_ICR_LO) & LAPIC_ICR_PENDING)
+        cpu_relax();
+    lapic_write(LAPIC_REG_ICR_HI, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LO, vector);
+}
+
 void lapic_timer_set_oneshot(uint8_t vector) {
     g_timer_vector = vector;
     lapic_write(LAPIC_REG_TMR_DIV, LAPIC_TIMER_DIV_16);
@@ -83,8 +136,8 @@ void lapic_timer_set_tsc_deadline(uint8_t vector) {
     lapic_write(LAPIC_REG_TMR_INITCNT, 0);
 }
 
-uint32_t lapic_timer_calibrate_tsc(uint64_t tsc_hz, uint32_t us) {
-    if (!g_lapic_base || !g_timer_vector || !tsc_hz || us == 0)
+uint64_t lapic_timer_calibrate_tsc(uint64_t tsc_hz, uint32_t us) {
+    if (!lapic_is_enabled() || !g_timer_vector || !tsc_hz || us == 0)
         return 0;
 
     lapic_write(LAPIC_REG_TMR_DIV, LAPIC_TIMER_DIV_16);
@@ -103,15 +156,15 @@ uint32_t lapic_timer_calibrate_tsc(uint64_t tsc_hz, uint32_t us) {
 
     uint32_t cur = lapic_read(LAPIC_REG_TMR_CURRCNT);
     uint64_t elapsed = (uint64_t)0xffffffffu - cur;
-    uint64_t tpu = elapsed / (uint64_t)us;
-    if (tpu == 0)
-        tpu = 1;
+    uint64_t hz = elapsed * 1000000ull / us;
+    if (hz == 0)
+        hz = 1;
     lapic_timer_stop();
-    return (uint32_t)tpu;
+    return hz;
 }
 
 uint32_t lapic_timer_calibrate_pit(uint32_t pit_us) {
-    if (!g_lapic_base || !g_timer_vector || pit_us == 0)
+    if (!lapic_is_enabled() || !g_timer_vector || pit_us == 0)
         return 0;
 
     lapic_write(LAPIC_REG_TMR_DIV, LAPIC_TIMER_DIV_16);
@@ -121,7 +174,7 @@ uint32_t lapic_timer_calibrate_pit(uint32_t pit_us) {
     lapic_write(LAPIC_REG_TMR_INITCNT, 0xffffffffu);
 
     while (pit_read_count() != 0)
-        _mm_pause();
+        cpu_pause();
 
     uint32_t cur = lapic_read(LAPIC_REG_TMR_CURRCNT);
     uint64_t elapsed = (uint64_t)0xffffffffu - cur;
@@ -133,7 +186,7 @@ uint32_t lapic_timer_calibrate_pit(uint32_t pit_us) {
 }
 
 void lapic_timer_oneshot(uint32_t ticks) {
-    if (!g_lapic_base || !g_timer_vector)
+    if (!lapic_is_enabled() || !g_timer_vector)
         return;
     if (ticks == 0)
         ticks = 1;
@@ -143,7 +196,7 @@ void lapic_timer_oneshot(uint32_t ticks) {
 }
 
 void lapic_timer_stop(void) {
-    if (!g_lapic_base || !g_timer_vector)
+    if (!lapic_is_enabled() || !g_timer_vector)
         return;
     lapic_write(LAPIC_REG_LVT_TIMER, (uint32_t)g_timer_vector | LAPIC_LVT_MASK);
     lapic_write(LAPIC_REG_TMR_INITCNT, 0);
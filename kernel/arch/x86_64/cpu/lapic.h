@@ -2,14 +2,28 @@
 #include <stdint.h>
 
 #define LAPIC_SPURIOUS_VECTOR 0xff
+#define LAPIC_RESCHED_VECTOR 0xf1
+
+/* the timer counts its input clock divided by this */
+#define LAPIC_TIMER_DIVISOR 16u
+
+typedef enum {
+    LAPIC_MODE_NONE = 0,
+    LAPIC_MODE_XAPIC,  // MMIO
+    LAPIC_MODE_X2APIC, // MSRs, 32-bit APIC IDs
+} lapic_mode_t;
 
 void lapic_init(void);
 int lapic_is_enabled(void);
+lapic_mode_t lapic_mode(void);
+uint32_t lapic_id(void);
 void lapic_eoi(void);
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
 
 void lapic_timer_set_oneshot(uint8_t vector);
 void lapic_timer_set_tsc_deadline(uint8_t vector);
 uint32_t lapic_timer_calibrate_pit(uint32_t pit_us);
-uint32_t lapic_timer_calibrate_tsc(uint64_t tsc_hz, uint32_t us);
+/* timer ticks per second, measured over us against the TSC */
+uint64_t lapic_timer_calibrate_tsc(uint64_t tsc_hz, uint32_t us);
 void lapic_timer_oneshot(uint32_t ticks);
 void lapic_timer_stop(void);
@@ -34,3 +34,43 @@ static inline uint64_t rdcr3(void) {
                      : "memory");
     return v;
 }
+
+static inline uint64_t rdcr0(void) {
+    uint64_t v;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov rax, cr0\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(v)
+                     :
+                     : "memory");
+    return v;
+}
+
+static inline void wrcr0(uint64_t v) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov cr0, rax\n"
+                     ".att_syntax prefix\n"
+                     :
+                     : "a"(v)
+                     : "memory");
+}
+
+static inline uint64_t rdcr4(void) {
+    uint64_t v;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov rax, cr4\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(v)
+                     :
+                     : "memory");
+    return v;
+}
+
+static inline void wrcr4(uint64_t v) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov cr4, rax\n"
+                     ".att_syntax prefix\n"
+                     :
+                     : "a"(v)
+                     : "memory");
+}
@@ -1,10 +1,10 @@
 #include "relax.h"
 #include "cpuid.h"
 #include "tsc.h"
-#include <emmintrin.h>
 #include <immintrin.h>
 
 static int g_has_tpause = 0;
+static int g_has_mwait = 0;
 static uint64_t g_tpause_step = 1000;
 static uint64_t g_tpause_deadline = 0;
 
@@ -15,7 +15,13 @@ static int cpu_has_waitpkg(void) {
     return (r.ecx >> 5) & 1u;
 }
 
+static int cpu_has_monitor(void) {
+    cpuid_regs_t r = cpuid(1, 0);
+    return (r.ecx >> 3) & 1u;
+}
+
 int cpu_has_tpause(void) { return g_has_tpause; }
+int cpu_has_mwait(void) { return g_has_mwait; }
 
 void cpu_relax_set_tpause_step(uint64_t tpause_step_cycles) {
     if (tpause_step_cycles)
@@ -24,6 +30,7 @@ void cpu_relax_set_tpause_step(uint64_t tpause_step_cycles) {
 
 void cpu_relax_init(uint64_t tpause_step_cycles) {
     g_has_tpause = cpu_has_waitpkg();
+    g_has_mwait = cpu_has_monitor();
     if (tpause_step_cycles)
         g_tpause_step = tpause_step_cycles;
     g_tpause_deadline = rdtsc();
@@ -31,7 +38,7 @@ void cpu_relax_init(uint64_t tpause_step_cycles) {
 
 void cpu_relax(void) {
     if (!g_has_tpause) {
-        _mm_pause();
+        cpu_pause();
         return;
     }
 
@@ -50,6 +57,58 @@ void cpu_relax(void) {
                      : "a"(lo), "d"(hi), "c"(0)
                      : "cc");
 #else
-    _mm_pause();
+    cpu_pause();
+#endif
+}
+
+/*
+ * TPAUSE in C0.1 (fast wake). The OS may cap the wait via
+ * IA32_UMWAIT_CONTROL, so loop until the deadline has really passed.
+ */
+void cpu_tpause_until(uint64_t tsc_deadline) {
+    while ((int64_t)(rdtsc() - tsc_deadline) < 0) {
+#if defined(__WAITPKG__)
+        uint32_t lo = (uint32_t)tsc_deadline;
+        uint32_t hi = (uint32_t)(tsc_deadline >> 32);
+        __asm__ volatile(".intel_syntax noprefix\n"
+                         "tpause ecx\n"
+                         ".att_syntax prefix\n"
+                         :
+                         : "a"(lo), "d"(hi), "c"(1)
+                         : "cc", "memory");
+#else
+        cpu_pause();
 #endif
+    }
+}
+
+void cpu_monitor(const volatile void *addr) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "monitor\n"
+                     ".att_syntax prefix\n"
+                     :
+                     : "a"(addr), "c"(0), "d"(0)
+                     : "memory");
+}
+
+/* ECX[0]: treat interrupts as break events even with IF clear */
+void cpu_mwait(uint32_t hint) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mwait\n"
+                     ".att_syntax prefix\n"
+                     :
+                     : "a"(hint), "c"(1)
+                     : "memory");
+}
+
+/* sti's interrupt shadow covers hlt, so no wakeup is lost in between */
+void cpu_halt(void) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "sti\n"
+                     "hlt\n"
+                     "cli\n"
+                     ".att_syntax prefix\n"
+                     :
+                     :
+                     : "memory");
 }
@@ -4,4 +4,14 @@
 void cpu_relax_init(uint64_t tpause_step_cycles);
 void cpu_relax_set_tpause_step(uint64_t tpause_step_cycles);
 void cpu_relax(void);
+
+/* spin-wait hint */
+static inline void cpu_pause(void) { __asm__ volatile("pause" ::: "memory"); }
 int cpu_has_tpause(void);
+int cpu_has_mwait(void);
+
+/* idle primitives; callers run with interrupts disabled */
+void cpu_tpause_until(uint64_t tsc_deadline);
+void cpu_monitor(const volatile void *addr);
+void cpu_mwait(uint32_t hint);
+void cpu_halt(void);
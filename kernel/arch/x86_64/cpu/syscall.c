@@ -1,44 +1,183 @@
 #include "syscall.h"
+#include "core/futex.h"
+#include "core/klog.h"
 #include "core/print.h"
+#include "core/sched.h"
+#include "core/utimer.h"
 #include "cpu_local.h"
 #include "gdt.h"
+#include "irqflags.h"
 #include "msr.h"
+#include "timer.h"
+#include "tsc.h"
+#include "uaccess.h"
 
 #define IA32_EFER 0xc0000080u
 #define IA32_STAR 0xc0000081u
 #define IA32_LSTAR 0xc0000082u
 #define IA32_FMASK 0xc0000084u
-#define IA32_GS_BASE 0xc0000101u
-#define IA32_KERNEL_GS_BASE 0xc0000102u
 
 #define EFER_SCE (1u << 0)
 
 extern void syscall_entry(void);
 
+typedef struct syscall_args {
+        uint64_t a1, a2, a3, a4, a5, a6;
+} syscall_args_t;
+
+typedef uint64_t (*syscall_fn_t)(const syscall_args_t *a);
+
+typedef struct syscall_stat {
+        uint64_t calls;
+        uint64_t tsc; // cycles spent in the handler
+} syscall_stat_t;
+
+/* one row per cpu, line aligned, so the hot path never shares a line */
+typedef struct syscall_stats {
+        syscall_stat_t num[SYS_COUNT];
+} __attribute__((aligned(64))) syscall_stats_t;
+
+static syscall_stats_t g_stats[MAX_CPUS];
+
+/* queued for klogd; returns the bytes taken, fewer if the ring is full */
+static uint64_t sys_debug_write(const syscall_args_t *a) {
+    return (uint64_t)klog_write_user(a->a1, a->a2);
+}
+
+__attribute__((noreturn)) static uint64_t sys_exit(const syscall_args_t *a) {
+    (void)a;
+    kprint("\n[user] exit()\n");
+    for (;;)
+        __asm__ volatile("cli; hlt");
+}
+
+static uint64_t sys_yield(const syscall_args_t *a) {
+    (void)a;
+    sched_yield();
+    return 0;
+}
+
+static uint64_t sys_sleep_ns(const syscall_args_t *a) {
+    thread_sleep_ns(a->a1);
+    return 0;
+}
+
+static uint64_t sys_sleep_until(const syscall_args_t *a) {
+    thread_sleep_until(a->a1);
+    return 0;
+}
+
+static uint64_t sys_set_nice(const syscall_args_t *a) {
+    // range-check the full register: narrowing first would let 2^32 pass as 0
+    int64_t nice = (int64_t)a->a1;
+    if (nice < NICE_MIN || nice > NICE_MAX)
+        return (uint64_t)-1;
+    return (uint64_t)(int64_t)sched_set_nice(sched_current(), (int)nice);
+}
+
+static uint64_t sys_set_deadline(const syscall_args_t *a) {
+    return (uint64_t)(int64_t)sched_set_deadline(sched_current(), a->a1,
+                                                 a->a2, a->a3);
+}
+
+static uint64_t sys_set_affinity(const syscall_args_t *a) {
+    return (uint64_t)(int64_t)sched_set_affinity(sched_current(), a->a1);
+}
+
+static uint64_t sys_futex_wait(const syscall_args_t *a) {
+    return (uint64_t)(int64_t)futex_wait(a->a1, (uint32_t)a->a2, a->a3);
+}
+
+static uint64_t sys_futex_wake(const syscall_args_t *a) {
+    return (uint64_t)(int64_t)futex_wake(a->a1, (uint32_t)a->a2);
+}
+
+static uint64_t sys_thread_stats(const syscall_args_t *a) {
+    thread_stats_info_t st;
+    sched_thread_stats(sched_current(), &st);
+    return (uint64_t)(int64_t)copy_to_user(a->a1, &st, sizeof(st));
+}
+
+static uint64_t sys_timer_create(const syscall_args_t *a) {
+    return (uint64_t)utimer_create(a->a1, a->a2, a->a3);
+}
+
+static uint64_t sys_timer_destroy(const syscall_args_t *a) {
+    return (uint64_t)(int64_t)utimer_destroy(a->a1);
+}
+
+static const syscall_fn_t g_syscalls[SYS_COUNT] = {
+    [SYS_debug_write] = sys_debug_write,
+    [SYS_exit] = sys_exit,
+    [SYS_yield] = sys_yield,
+    [SYS_sleep_ns] = sys_sleep_ns,
+    [SYS_sleep_until] = sys_sleep_until,
+    [SYS_set_nice] = sys_set_nice,
+    [SYS_set_deadline] = sys_set_deadline,
+    [SYS_set_affinity] = sys_set_affinity,
+    [SYS_futex_wait] = sys_futex_wait,
+    [SYS_futex_wake] = sys_futex_wake,
+    [SYS_thread_stats] = sys_thread_stats,
+    [SYS_timer_create] = sys_timer_create,
+    [SYS_timer_destroy] = sys_timer_destroy,
+};
+
+static const char *const g_syscall_names[SYS_COUNT] = {
+    [SYS_debug_write] = "debug_write",
+    [SYS_exit] = "exit",
+    [SYS_yield] = "yield",
+    [SYS_sleep_ns] = "sleep_ns",
+    [SYS_sleep_until] = "sleep_until",
+    [SYS_set_nice] = "set_nice",
+    [SYS_set_deadline] = "set_deadline",
+    [SYS_set_affinity] = "set_affinity",
+    [SYS_futex_wait] = "futex_wait",
+    [SYS_futex_wake] = "futex_wake",
+    [SYS_thread_stats] = "thread_stats",
+    [SYS_timer_create] = "timer_create",
+    [SYS_timer_destroy] = "timer_destroy",
+};
+
 uint64_t syscall_dispatch(uint64_t num, uint64_t a1, uint64_t a2, uint64_t a3,
                           uint64_t a4, uint64_t a5, uint64_t a6) {
-    (void)a3;
-    (void)a4;
-    (void)a5;
-    (void)a6;
-
-    switch (num) {
-    case SYS_debug_write: {
-        const char *s = (const char *)a1;
-        uint64_t len = a2;
-        for (uint64_t i = 0; i < len; i++) {
-            kprint((char[]){s[i], 0});
-        }
-        return len;
-    }
-    case SYS_exit:
-        kprint("\n[user] exit()\n");
-        for (;;)
-            __asm__ volatile("cli; hlt");
-    default:
+    if (num >= SYS_COUNT || !g_syscalls[num]) {
         kprint("\n[syscall] unknown\n");
         return (uint64_t)-1;
     }
+
+    const syscall_args_t args = {a1, a2, a3, a4, a5, a6};
+    uint64_t start = rdtsc();
+    uint64_t ret = g_syscalls[num](&args);
+    uint64_t cycles = rdtsc() - start;
+
+    // blocking calls may return on another cpu: charge the one we are on
+    uint64_t flags = cpu_irq_save();
+    syscall_stat_t *st = &g_stats[this_cpu_id()].num[num];
+    st->calls++;
+    st->tsc += cycles;
+    cpu_irq_restore(flags);
+    return ret;
+}
+
+/*
+ * Summed over cpus without locks; a count racing a call in flight is at
+ * worst one call stale.
+ */
+void syscall_dump_stats(void) {
+    kprintln("[syscall] name calls avg_ns total_us");
+    for (uint32_t num = 0; num < SYS_COUNT; num++) {
+        uint64_t calls = 0, tsc = 0;
+        for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+            calls += g_stats[cpu].num[num].calls;
+            tsc += g_stats[cpu].num[num].tsc;
+        }
+        if (!calls)
+            continue;
+        uint64_t ns = timer_tsc_to_ns(tsc);
+        kprintlnf("[syscall] %s %llu %llu %llu", g_syscall_names[num],
+                  (unsigned long long)calls, (unsigned long long)(ns / calls),
+                  (unsigned long long)(ns / 1000));
+    }
 }
 
 void syscall_init() {
@@ -66,8 +205,5 @@ void syscall_init() {
 
     wrmsr(IA32_FMASK, (1u << 9));
 
-    wrmsr(IA32_GS_BASE, 0);
-    wrmsr(IA32_KERNEL_GS_BASE, (uint64_t)&g_cpu_local);
-
     kprint("[syscall] init ok\n");
 }
@@ -2,8 +2,22 @@
 #include <stdint.h>
 
 void syscall_init(void);
+/* per-syscall call counts and time spent, summed over cpus */
+void syscall_dump_stats(void);
 
 enum {
     SYS_debug_write = 0,
     SYS_exit = 1,
+    SYS_yield = 2,
+    SYS_sleep_ns = 3,       // a1 = relative ns
+    SYS_sleep_until = 4,    // a1 = absolute timer_now_ns() deadline
+    SYS_set_nice = 5,       // a1 = nice, -20..19
+    SYS_set_deadline = 6,   // a1 = runtime, a2 = deadline, a3 = period (ns)
+    SYS_set_affinity = 7,   // a1 = cpu mask
+    SYS_futex_wait = 8,     // a1 = addr, a2 = expected, a3 = timeout ns
+    SYS_futex_wake = 9,     // a1 = addr, a2 = max waiters to wake
+    SYS_thread_stats = 10,  // a1 = thread_stats_info_t * (calling thread)
+    SYS_timer_create = 11,  // a1 = first deadline, a2 = period ns, a3 = word
+    SYS_timer_destroy = 12, // a1 = handle
+    SYS_COUNT,
 };
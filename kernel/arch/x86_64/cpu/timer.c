@@ -2,93 +2,125 @@
 #include "cpuid.h"
 #include "lapic.h"
 #include "msr.h"
-#include "pit.h"
+#include "pmm.h"
 #include "relax.h"
 #include "tsc.h"
+#include "tsc_calib.h"
+#include "tsc_sync.h"
+#include "vmm.h"
+
+#include "core/seqcount.h"
+#include "core/spinlock.h"
+#include "uapi/vclock.h"
 
-#include <immintrin.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <x86intrin.h>
 
 #define IA32_TSC_DEADLINE 0x6e0
-#define TIMER_CAL_US 10000u
+#define TIMER_CAL_US 2000u // per LAPIC calibration sample
+#define TIMER_CAL_SAMPLES 3
+#define NSEC_PER_SEC 1000000000ull
 
 static timer_source_t g_src = TIMER_SRC_NONE;
 static uint8_t g_vector = 0;
+static uint64_t g_tsc_hz = 0;
+static const char *g_calib_method = "none";
 
 /*
- * Single fixed-point conversion path:
- *
- *   ticks = (ns * scale) >> 32
- *   scale = (tick_num / tick_den) * 2^32
+ * Division-free conversions, clocksource style:
  *
- * where tick_num / tick_den is "ticks per nanosecond".
+ *   to = (from * mult) >> shift
  *
- * - For TSC-deadline: tick_num = tsc_hz, tick_den = 1e9
- * - For LAPIC:        tick_num = (ticks_per_us * 1000), tick_den = 1e9
- *                     (because ticks_per_us / 1000 = ticks_per_ns)
+ * mult/shift are picked once at init as the most precise pair for which
+ * from * mult cannot overflow 64 bits as long as `from` spans at most
+ * TIMER_HORIZON_S seconds. timer_now_ns() therefore converts the distance
+ * from a recent base rather than the raw TSC, and moves the base forward
+ * (under a seqcount) before that distance gets close to the horizon.
  */
-static uint64_t g_tick_num = 0;
-static uint64_t g_tick_den = 1;
-static uint64_t g_scale = 0;
-static uint32_t g_scale_shift = 32;
+#define TIMER_HORIZON_S 600u
 
-static inline uint64_t rdtsc_ordered(void) {
-    _mm_lfence();
-    uint64_t t = _rdtsc();
-    _mm_lfence();
-    return t;
-}
+typedef struct clock_conv {
+        uint32_t mult;
+        uint32_t shift;
+} clock_conv_t;
 
-static inline uint64_t mul_u64_div_u64(uint64_t a, uint64_t b, uint64_t d) {
-    if (d == 0)
-        return 0;
-    uint64_t lo, hi, q, r;
-
-    // RDX:RAX = a * b
-    __asm__ volatile(".intel_syntax noprefix\n"
-                     "mul rcx\n"
-                     ".att_syntax prefix\n"
-                     : "=a"(lo), "=d"(hi)
-                     : "a"(a), "c"(b)
-                     : "cc");
+static clock_conv_t g_tsc_to_ns;
+static clock_conv_t g_ns_to_tsc;
+static clock_conv_t g_ns_to_tick; // ns -> ticks of the one-shot source
+static uint64_t g_horizon_ns;
 
-    // if hi >= d, (hi:lo)/d would overflow 64-bit quotient. saturate.
-    if (hi >= d)
-        return UINT64_MAX;
+/* clock base, readers go through g_clock_seq */
+static seqcount_t g_clock_seq = SEQCOUNT_INIT;
+static spinlock_t g_rebase_lock = SPINLOCK_INIT;
+static uint64_t g_base_tsc;
+static uint64_t g_base_ns;
+static uint64_t g_rebase_cycles; // move the base once this far from it
 
-    // quotient = (hi:lo) / d
-    __asm__ volatile(".intel_syntax noprefix\n"
-                     "div rcx\n"
-                     ".att_syntax prefix\n"
-                     : "=a"(q), "=d"(r)
-                     : "a"(lo), "d"(hi), "c"(d)
-                     : "cc");
+/* user-visible copy of the above, see uapi/vclock.h */
+static vclock_page_t *g_vclock;
 
-    (void)r;
-    return q;
+static inline uint64_t rdtsc_ordered(void) {
+    lfence();
+    uint64_t t = _rdtsc();
+    lfence();
+    return t;
 }
 
-static inline void timer_set_scale(uint64_t num, uint64_t den) {
-    g_scale_shift = 32;
-    g_scale = mul_u64_div_u64(num, 1ull << g_scale_shift, den);
+static void clock_conv_init(clock_conv_t *c, uint64_t from_hz, uint64_t to_hz,
+                            uint32_t horizon_s) {
+    // bits of headroom left once `from` covers the horizon
+    uint64_t tmp = ((uint64_t)horizon_s * from_hz) >> 32;
+    uint32_t shift_acc = 32;
+    while (tmp) {
+        tmp >>= 1;
+        shift_acc--;
+    }
+
+    // largest shift whose mult still fits that headroom
+    uint32_t shift;
+    for (shift = 32; shift > 0; shift--) {
+        if (to_hz >> (64 - shift))
+            continue; // to_hz << shift would overflow
+        tmp = (to_hz << shift) + from_hz / 2;
+        tmp /= from_hz;
+        if (!(tmp >> shift_acc))
+            break;
+    }
+    c->mult = (uint32_t)tmp;
+    c->shift = shift;
 }
 
-static inline uint64_t ticks_from_ns(uint64_t ns) {
-    if (!g_scale)
-        return 0;
-    // 128-bit product via MUL: RDX:RAX = ns * g_scale
+/* no horizon limit: 128-bit product, for arbitrary spans */
+static inline uint64_t clock_conv_wide(const clock_conv_t *c, uint64_t v) {
     uint64_t lo, hi;
+    // RDX:RAX = v * mult
     __asm__ volatile(".intel_syntax noprefix\n"
                      "mul rcx\n"
                      ".att_syntax prefix\n"
                      : "=a"(lo), "=d"(hi)
-                     : "a"(ns), "c"(g_scale)
+                     : "a"(v), "c"((uint64_t)c->mult)
                      : "cc");
+    if (!c->shift)
+        return lo;
+    return (hi << (64 - c->shift)) | (lo >> c->shift);
+}
+
+static inline uint64_t clock_conv(const clock_conv_t *c, uint64_t v) {
+    return (v * c->mult) >> c->shift;
+}
 
-    // (RDX:RAX) >> 32, truncated to 64-bit
-    return (hi << 32) | (lo >> 32);
+static uint64_t median3(const uint64_t *v) {
+    uint64_t a = v[0], b = v[1], c = v[2];
+    if (a > b) {
+        uint64_t t = a;
+        a = b;
+        b = t;
+    }
+    // a <= b; the median is b unless c falls below it
+    if (c < b)
+        b = (c > a) ? c : a;
+    return b;
 }
 
 static int cpu_has_tsc_deadline(void) {
@@ -103,43 +135,46 @@ static int cpu_has_invariant_tsc(void) {
     return (r.edx >> 8) & 1u;
 }
 
-static uint64_t tsc_hz_from_cpuid(void) {
-    uint32_t max = cpuid_max_leaf();
-
-    if (max >= 0x15) {
-        cpuid_regs_t r15 = cpuid(0x15, 0);
-        if (r15.eax && r15.ebx) {
-            uint64_t crystal = r15.ecx;
-            if (!crystal && max >= 0x16) {
-                cpuid_regs_t r16 = cpuid(0x16, 0);
-                if (r16.eax)
-                    return (uint64_t)r16.eax * 1000000ull;
-                return 0;
-            }
-            if (crystal)
-                return (crystal * (uint64_t)r15.ebx) / (uint64_t)r15.eax;
-        }
-    }
+/* republish the clock to user space; writers hold g_rebase_lock */
+static void vclock_publish(void) {
+    vclock_page_t *p = g_vclock;
+    if (!p)
+        return;
 
-    if (max >= 0x16) {
-        cpuid_regs_t r16 = cpuid(0x16, 0);
-        if (r16.eax)
-            return (uint64_t)r16.eax * 1000000ull;
-    }
-    return 0;
+    p->seq++;
+    seq_barrier();
+    p->base_tsc = g_base_tsc;
+    p->base_ns = g_base_ns;
+    p->mult = g_tsc_to_ns.mult;
+    p->shift = g_tsc_to_ns.shift;
+    for (uint32_t i = 0; i < VCLOCK_MAX_CPUS && i < MAX_CPUS; i++)
+        p->tsc_offset[i] = g_tsc_offset[i];
+    p->use_offsets = g_tsc_use_offsets;
+    p->mode = VCLOCK_MODE_TSC;
+    seq_barrier();
+    p->seq++;
 }
 
-static uint64_t tsc_hz_calibrate_pit(uint32_t pit_us) {
-    if (pit_us == 0)
-        return 0;
-    pit_oneshot_us(pit_us);
-    uint64_t start = rdtsc_ordered();
-    while (pit_read_count() != 0)
-        _mm_pause();
-    uint64_t end = rdtsc_ordered();
+/* one zeroed page, mapped into every user address space */
+static void vclock_init(void) {
+    void *phys = pmm_alloc_pages(1);
+    if (!phys)
+        return; // user space falls back to asking the kernel
 
-    uint64_t delta = end - start;
-    return (delta * 1000000ull) / pit_us;
+    uint8_t *page = (uint8_t *)phys_to_virt((uint64_t)phys);
+    for (size_t i = 0; i < PAGE_SIZE; i++)
+        page[i] = 0;
+    if (vmm_add_shared_user_page(VCLOCK_USER_VA, (uint64_t)phys))
+        return;
+
+    g_vclock = (vclock_page_t *)page;
+    vclock_publish();
+}
+
+void timer_vclock_update(void) {
+    uint64_t flags = spin_lock_irqsave(&g_rebase_lock);
+    vclock_publish();
+    spin_unlock_irqrestore(&g_rebase_lock, flags);
 }
 
 int timer_init(uint8_t vector) {
@@ -152,55 +187,69 @@ int timer_init(uint8_t vector) {
     if (!has_invtsc)
         return -1;
 
-    uint64_t tsc_hz = tsc_hz_from_cpuid();
-    if (!tsc_hz)
-        tsc_hz = tsc_hz_calibrate_pit(TIMER_CAL_US);
-    if (!tsc_hz)
+    tsc_calib_t cal;
+    if (tsc_calibrate(&cal))
         return -1;
+    uint64_t tsc_hz = cal.tsc_hz;
+    g_tsc_hz = tsc_hz;
+    g_calib_method = cal.method;
+    tsc_sync_init_bsp();
+
+    clock_conv_init(&g_tsc_to_ns, tsc_hz, NSEC_PER_SEC, TIMER_HORIZON_S);
+    clock_conv_init(&g_ns_to_tsc, NSEC_PER_SEC, tsc_hz, TIMER_HORIZON_S);
+    g_horizon_ns = (uint64_t)TIMER_HORIZON_S * NSEC_PER_SEC;
+    g_rebase_cycles = (uint64_t)TIMER_HORIZON_S / 2 * tsc_hz;
+    g_base_tsc = rdtsc_ordered();
+    g_base_ns = clock_conv_wide(&g_tsc_to_ns, g_base_tsc);
+    vclock_init();
 
     if (has_deadline) {
         g_src = TIMER_SRC_TSC_DEADLINE;
-
-        g_tick_num = tsc_hz;
-        g_tick_den = 1000000000ull; // 1e9 ns/sec
-        timer_set_scale(g_tick_num, g_tick_den);
+        g_ns_to_tick = g_ns_to_tsc;
 
         lapic_timer_set_tsc_deadline(vector);
         timer_stop();
         return 0;
     }
 
-    // fallback: LAPIC one-shot calibrated against TSC
+    // fallback: LAPIC one-shot, clocked as the hypervisor says or
+    // measured against the TSC
     lapic_timer_set_oneshot(vector);
-    uint32_t tpu = lapic_timer_calibrate_tsc(tsc_hz, TIMER_CAL_US);
-    if (!tpu)
+    uint64_t tick_hz = cal.lapic_hz / LAPIC_TIMER_DIVISOR;
+    if (!tick_hz) {
+        uint64_t samples[TIMER_CAL_SAMPLES];
+        for (uint32_t i = 0; i < TIMER_CAL_SAMPLES; i++)
+            samples[i] = lapic_timer_calibrate_tsc(tsc_hz, TIMER_CAL_US);
+        tick_hz = median3(samples);
+    }
+    if (!tick_hz)
         return -1;
 
     g_src = TIMER_SRC_LAPIC;
-
-    // convert TPU -> ticks per ns by multiplying numerator by 1000 and using
-    // 1e9 denominator
-    g_tick_num = (uint64_t)tpu * 1000ull;
-    g_tick_den = 1000000000ull;
-    timer_set_scale(g_tick_num, g_tick_den);
+    clock_conv_init(&g_ns_to_tick, NSEC_PER_SEC, tick_hz, TIMER_HORIZON_S);
 
     timer_stop();
     return 0;
 }
 
 timer_source_t timer_source(void) { return g_src; }
+uint64_t timer_tsc_hz(void) { return g_tsc_hz; }
+const char *timer_calib_method(void) { return g_calib_method; }
 uint8_t timer_vector(void) { return g_vector; }
 
 void timer_oneshot_ns(uint64_t ns) {
-    if (!g_tick_num || !g_scale)
+    if (!g_ns_to_tick.mult)
         return;
 
-    uint64_t ticks = ticks_from_ns(ns);
+    // past the horizon the conversion would overflow; firing early is
+    // harmless, the expiry path just re-arms
+    if (ns > g_horizon_ns)
+        ns = g_horizon_ns;
+    uint64_t ticks = clock_conv(&g_ns_to_tick, ns);
     if (ticks == 0)
         ticks = 1;
 
     if (g_src == TIMER_SRC_TSC_DEADLINE) {
-        // TODO: 64 bit ticks are used, clamp for max sleep bound
         // Ensure the LVT stays in TSC-deadline mode and unmasked.
         lapic_timer_set_tsc_deadline(g_vector);
         const uint64_t now = rdtsc_ordered();
@@ -229,9 +278,61 @@ void timer_stop(void) {
     }
 }
 
-uint64_t timer_now_ns(void) {
-    if (!g_tick_num)
+/*
+ * Move the base up to tsc; losing the race to another cpu is fine.
+ * Interrupts stay off throughout: a tick landing inside the write side
+ * would read the clock on this cpu and spin on the odd count forever.
+ */
+static void timer_rebase(uint64_t tsc) {
+    uint64_t flags = cpu_irq_save();
+    if (!spin_trylock(&g_rebase_lock)) {
+        cpu_irq_restore(flags);
+        return;
+    }
+    write_seqcount_begin(&g_clock_seq);
+    if (tsc > g_base_tsc) {
+        g_base_ns += clock_conv_wide(&g_tsc_to_ns, tsc - g_base_tsc);
+        g_base_tsc = tsc;
+    }
+    write_seqcount_end(&g_clock_seq);
+    vclock_publish();
+    spin_unlock_irqrestore(&g_rebase_lock, flags);
+}
+
+static inline uint64_t timer_tsc_now_ns(int ordered) {
+    if (!g_tsc_to_ns.mult)
         return 0;
-    uint64_t tsc = rdtsc_ordered();
-    return mul_u64_div_u64(tsc, g_tick_den, g_tick_num);
+
+    uint32_t seq;
+    uint64_t tsc, base_tsc, base_ns;
+    do {
+        seq = read_seqcount_begin(&g_clock_seq);
+        base_tsc = g_base_tsc;
+        base_ns = g_base_ns;
+        // per-cpu offsets if the APs' TSCs disagree, see tsc_sync.h
+        tsc = tsc_read_synced(ordered);
+    } while (read_seqcount_retry(&g_clock_seq, seq));
+
+    // an unfenced read may be taken before the base it is compared to
+    uint64_t delta = tsc > base_tsc ? tsc - base_tsc : 0;
+    if (delta < g_rebase_cycles)
+        return base_ns + clock_conv(&g_tsc_to_ns, delta);
+
+    // long idle can overshoot the horizon: convert this one the slow way
+    uint64_t ns = base_ns + clock_conv_wide(&g_tsc_to_ns, delta);
+    timer_rebase(tsc);
+    return ns;
+}
+
+uint64_t timer_now_ns(void) { return timer_tsc_now_ns(1); }
+uint64_t timer_now_ns_fast(void) { return timer_tsc_now_ns(0); }
+
+uint64_t timer_ns_to_tsc(uint64_t ns) {
+    if (ns > g_horizon_ns)
+        return clock_conv_wide(&g_ns_to_tsc, ns);
+    return clock_conv(&g_ns_to_tsc, ns);
+}
+
+uint64_t timer_tsc_to_ns(uint64_t tsc) {
+    return clock_conv_wide(&g_tsc_to_ns, tsc);
 }
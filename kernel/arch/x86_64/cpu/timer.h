@@ -9,9 +9,19 @@ typedef enum {
 
 int timer_init(uint8_t vector);
 timer_source_t timer_source(void);
+uint64_t timer_tsc_hz(void);
+/* where timer_tsc_hz() came from, for the boot log */
+const char *timer_calib_method(void);
 uint8_t timer_vector(void);
 
 void timer_oneshot_ns(uint64_t ns);
 void timer_stop(void);
 
+/* ns since TSC reset; ordered against surrounding loads and stores */
 uint64_t timer_now_ns(void);
+/* same clock without the fences, for callers that only need a timestamp */
+uint64_t timer_now_ns_fast(void);
+uint64_t timer_ns_to_tsc(uint64_t ns);
+uint64_t timer_tsc_to_ns(uint64_t tsc);
+/* refresh the user clock page after the TSC offsets changed */
+void timer_vclock_update(void);
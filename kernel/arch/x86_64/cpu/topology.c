@@ -0,0 +1,77 @@
+#include "topology.h"
+#include "cpu_local.h"
+#include "cpuid.h"
+
+/* CPUID 0x1F / 0xB level types */
+#define TOPO_LEVEL_INVALID 0
+#define TOPO_LEVEL_SMT 1
+
+static cpu_topo_t g_topo[MAX_CPUS];
+
+/*
+ * Walk the extended topology leaf. Each subleaf gives the shift to apply
+ * to the x2APIC id to get to the next level up; the SMT level's shift
+ * strips the thread bits, the last level's strips everything below the
+ * package. 0x1F knows about modules/dies too, which only move the package
+ * boundary here.
+ */
+static int topo_from_leaf(uint32_t leaf, cpu_topo_t *out) {
+    uint32_t smt_shift = 0, pkg_shift = 0;
+    uint32_t apic_id = 0;
+    int levels = 0;
+
+    for (uint32_t sub = 0; sub < 8; sub++) {
+        cpuid_regs_t r = cpuid(leaf, sub);
+        uint32_t type = (r.ecx >> 8) & 0xff;
+        if (type == TOPO_LEVEL_INVALID)
+            break;
+
+        uint32_t shift = r.eax & 0x1f;
+        if (type == TOPO_LEVEL_SMT)
+            smt_shift = shift;
+        pkg_shift = shift;
+        apic_id = r.edx;
+        levels++;
+    }
+
+    if (!levels)
+        return -1;
+
+    out->apic_id = apic_id;
+    out->smt_id = apic_id & ((1u << smt_shift) - 1);
+    out->core_id = (apic_id & ((1u << pkg_shift) - 1)) >> smt_shift;
+    out->pkg_id = (pkg_shift < 32) ? apic_id >> pkg_shift : 0;
+    return 0;
+}
+
+void topology_init_cpu(uint32_t cpu) {
+    cpu_topo_t *t = &g_topo[cpu];
+    uint32_t max = cpuid_max_leaf();
+
+    int ok = (max >= 0x1f && !topo_from_leaf(0x1f, t)) ||
+             (max >= 0xb && !topo_from_leaf(0xb, t));
+    if (!ok) {
+        // no extended leaf: one thread per core, one core per package
+        t->apic_id = cpuid(1, 0).ebx >> 24;
+        t->smt_id = 0;
+        t->core_id = 0;
+        t->pkg_id = t->apic_id;
+    }
+
+    if (g_cpus[cpu])
+        g_cpus[cpu]->apic_id = t->apic_id;
+}
+
+const cpu_topo_t *topology_of(uint32_t cpu) { return &g_topo[cpu]; }
+
+topo_distance_t topology_distance(uint32_t a, uint32_t b) {
+    if (a == b)
+        return TOPO_SAME_CPU;
+
+    const cpu_topo_t *x = &g_topo[a], *y = &g_topo[b];
+    if (x->pkg_id != y->pkg_id)
+        return TOPO_REMOTE;
+    if (x->core_id == y->core_id)
+        return TOPO_SMT;
+    return TOPO_PACKAGE;
+}
@@ -0,0 +1,23 @@
+#pragma once
+#include <stdint.h>
+
+/* position of one logical cpu, decoded from its x2APIC id */
+typedef struct cpu_topo {
+        uint32_t apic_id;
+        uint32_t smt_id;  // thread within the core
+        uint32_t core_id; // core within the package
+        uint32_t pkg_id;
+} cpu_topo_t;
+
+/* how much cache two cpus share, closest first */
+typedef enum {
+    TOPO_SAME_CPU = 0,
+    TOPO_SMT,     // siblings: L1/L2 shared
+    TOPO_PACKAGE, // same package: LLC shared
+    TOPO_REMOTE,
+} topo_distance_t;
+
+/* run on the cpu being described; fills in its cpu_local apic_id too */
+void topology_init_cpu(uint32_t cpu);
+const cpu_topo_t *topology_of(uint32_t cpu);
+topo_distance_t topology_distance(uint32_t a, uint32_t b);
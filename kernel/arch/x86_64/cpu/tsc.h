@@ -1,9 +1,11 @@
 #pragma once
-#include <immintrin.h>
 #include <stdint.h>
 #include <x86intrin.h>
 
+/* loads before it complete, and nothing after it starts, until it retires */
+static inline void lfence(void) { __asm__ volatile("lfence" ::: "memory"); }
+
 static inline uint64_t rdtsc(void) {
-    _mm_lfence();
+    lfence();
     return (uint64_t)_rdtsc();
 }
@@ -0,0 +1,215 @@
+#include "tsc_calib.h"
+#include "cpuid.h"
+#include "io.h"
+#include "mmio.h"
+#include "pit.h"
+#include "relax.h"
+#include "tsc.h"
+
+#include "acpi/acpi.h"
+
+#include <stddef.h>
+#include <x86intrin.h>
+
+#define TSC_CAL_SAMPLES 5
+#define TSC_CAL_SAMPLE_US 1000u // per sample; the median absorbs outliers
+#define TSC_CAL_PIT_US 10000u
+#define TSC_CAL_STAMP_TRIES 4
+
+#define HV_LEAF_BASE 0x40000000u
+#define HV_LEAF_TIMING 0x40000010u // eax: TSC kHz, ebx: APIC bus kHz
+
+#define HPET_REG_CAP 0x000
+#define HPET_REG_CONFIG 0x010
+#define HPET_REG_COUNTER 0x0f0
+#define HPET_CAP_COUNT_64 (1ull << 13)
+#define HPET_CONFIG_ENABLE 1ull
+#define FS_PER_SEC 1000000000000000ull
+
+/* a free-running counter to measure the TSC against */
+typedef struct ref_clock {
+        const char *name;
+        uint64_t hz;
+        uint64_t mask; // counter width
+        uint64_t (*read)(void);
+} ref_clock_t;
+
+static uintptr_t g_hpet;
+static uint16_t g_pm_port;
+
+static inline uint64_t rdtsc_ordered(void) {
+    lfence();
+    uint64_t t = _rdtsc();
+    lfence();
+    return t;
+}
+
+static uint64_t hpet_read(void) { return mmio_read64(g_hpet, HPET_REG_COUNTER); }
+static uint64_t pm_timer_read(void) { return inl(g_pm_port); }
+
+/* crystal-derived, exact; only when the crystal frequency is given */
+static uint64_t tsc_hz_cpuid_15(void) {
+    if (cpuid_max_leaf() < 0x15)
+        return 0;
+    cpuid_regs_t r = cpuid(0x15, 0);
+    if (!r.eax || !r.ebx || !r.ecx)
+        return 0;
+    return ((uint64_t)r.ecx * r.ebx) / r.eax;
+}
+
+/* nominal base frequency in MHz; close, but not the exact TSC rate */
+static uint64_t tsc_hz_cpuid_16(void) {
+    if (cpuid_max_leaf() < 0x16)
+        return 0;
+    return (uint64_t)cpuid(0x16, 0).eax * 1000000ull;
+}
+
+/* VMware-style timing leaf, also offered by KVM and others */
+static uint64_t tsc_hz_hypervisor(uint64_t *lapic_hz) {
+    if (!((cpuid(1, 0).ecx >> 31) & 1u))
+        return 0;
+    if (cpuid(HV_LEAF_BASE, 0).eax < HV_LEAF_TIMING)
+        return 0;
+    cpuid_regs_t r = cpuid(HV_LEAF_TIMING, 0);
+    if (!r.eax)
+        return 0;
+    *lapic_hz = (uint64_t)r.ebx * 1000ull;
+    return (uint64_t)r.eax * 1000ull;
+}
+
+static int hpet_setup(ref_clock_t *c) {
+    const acpi_hpet_t *t = (const acpi_hpet_t *)acpi_find_table("HPET");
+    if (!t || t->base.space_id != ACPI_GAS_MEMORY || !t->base.address)
+        return -1;
+
+    g_hpet = mmio_map_page((uintptr_t)t->base.address);
+    if (!g_hpet)
+        return -1;
+
+    uint64_t cap = mmio_read64(g_hpet, HPET_REG_CAP);
+    uint64_t period_fs = cap >> 32;
+    if (!period_fs || period_fs > 100000000ull) // spec: at most 100 ns
+        return -1;
+
+    uint64_t cfg = mmio_read64(g_hpet, HPET_REG_CONFIG);
+    if (!(cfg & HPET_CONFIG_ENABLE))
+        mmio_write64(g_hpet, HPET_REG_CONFIG, cfg | HPET_CONFIG_ENABLE);
+
+    c->name = "hpet";
+    c->hz = FS_PER_SEC / period_fs;
+    c->mask = (cap & HPET_CAP_COUNT_64) ? UINT64_MAX : 0xffffffffull;
+    c->read = hpet_read;
+    return 0;
+}
+
+static int pm_timer_setup(ref_clock_t *c) {
+    uint32_t bits;
+    if (acpi_pm_timer(&g_pm_port, &bits))
+        return -1;
+
+    c->name = "acpi pm timer";
+    c->hz = ACPI_PM_TIMER_HZ;
+    c->mask = (bits == 32) ? 0xffffffffull : 0xffffffull;
+    c->read = pm_timer_read;
+    return 0;
+}
+
+/*
+ * Reference reading paired with the TSC at the same instant: the read is
+ * bracketed by two TSC reads and the tightest bracket of a few wins, so a
+ * slow (trapped, under a hypervisor) read doesn't skew the pairing.
+ */
+static uint64_t ref_stamp(const ref_clock_t *c, uint64_t *tsc) {
+    uint64_t best = UINT64_MAX, ref = 0;
+    for (int i = 0; i < TSC_CAL_STAMP_TRIES; i++) {
+        uint64_t t0 = rdtsc_ordered();
+        uint64_t r = c->read();
+        uint64_t t1 = rdtsc_ordered();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+            ref = r;
+            *tsc = t0 + (t1 - t0) / 2;
+        }
+    }
+    return ref;
+}
+
+static uint64_t ref_sample(const ref_clock_t *c, uint32_t us) {
+    uint64_t tsc0, tsc1;
+    uint64_t want = c->hz * us / 1000000ull;
+
+    uint64_t r0 = ref_stamp(c, &tsc0);
+    while (((c->read() - r0) & c->mask) < want)
+        cpu_relax();
+    uint64_t r1 = ref_stamp(c, &tsc1);
+
+    uint64_t ticks = (r1 - r0) & c->mask;
+    if (!ticks)
+        return 0;
+    return (tsc1 - tsc0) * c->hz / ticks;
+}
+
+static uint64_t median(uint64_t *v, uint32_t n) {
+    for (uint32_t i = 1; i < n; i++) {
+        uint64_t x = v[i];
+        uint32_t j = i;
+        for (; j > 0 && v[j - 1] > x; j--)
+            v[j] = v[j - 1];
+        v[j] = x;
+    }
+    return v[n / 2];
+}
+
+static uint64_t tsc_hz_measure(const ref_clock_t *c) {
+    uint64_t samples[TSC_CAL_SAMPLES];
+    for (uint32_t i = 0; i < TSC_CAL_SAMPLES; i++)
+        samples[i] = ref_sample(c, TSC_CAL_SAMPLE_US);
+    return median(samples, TSC_CAL_SAMPLES);
+}
+
+static uint64_t tsc_hz_calibrate_pit(uint32_t pit_us) {
+    pit_oneshot_us(pit_us);
+    uint64_t start = rdtsc_ordered();
+    while (pit_read_count() != 0)
+        cpu_pause();
+    uint64_t end = rdtsc_ordered();
+
+    uint64_t delta = end - start;
+    return (delta * 1000000ull) / pit_us;
+}
+
+/* measured sources, best first */
+static int (*const g_ref_setup[])(ref_clock_t *) = {hpet_setup,
+                                                     pm_timer_setup};
+
+int tsc_calibrate(tsc_calib_t *out) {
+    out->lapic_hz = 0;
+
+    if ((out->tsc_hz = tsc_hz_cpuid_15())) {
+        out->method = "cpuid 0x15";
+        return 0;
+    }
+    if ((out->tsc_hz = tsc_hz_hypervisor(&out->lapic_hz))) {
+        out->method = "hypervisor cpuid";
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(g_ref_setup) / sizeof(g_ref_setup[0]);
+         i++) {
+        ref_clock_t ref;
+        if (g_ref_setup[i](&ref))
+            continue;
+        if ((out->tsc_hz = tsc_hz_measure(&ref))) {
+            out->method = ref.name;
+            return 0;
+        }
+    }
+    if ((out->tsc_hz = tsc_hz_cpuid_16())) {
+        out->method = "cpuid 0x16";
+        return 0;
+    }
+    if ((out->tsc_hz = tsc_hz_calibrate_pit(TSC_CAL_PIT_US))) {
+        out->method = "pit";
+        return 0;
+    }
+    return -1;
+}
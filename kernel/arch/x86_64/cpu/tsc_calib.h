@@ -0,0 +1,16 @@
+#pragma once
+#include <stdint.h>
+
+typedef struct tsc_calib {
+        uint64_t tsc_hz;
+        uint64_t lapic_hz; // LAPIC timer input clock if known, else 0
+        const char *method;
+} tsc_calib_t;
+
+/*
+ * Find the TSC frequency, cheapest trustworthy source first: CPUID leaf
+ * 0x15, the hypervisor timing leaf, then short measurements against the
+ * HPET or the ACPI PM timer (median of several), then CPUID leaf 0x16,
+ * then the PIT. Returns -1 if nothing worked.
+ */
+int tsc_calibrate(tsc_calib_t *out);
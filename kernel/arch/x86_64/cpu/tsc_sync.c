@@ -0,0 +1,165 @@
+#include "tsc_sync.h"
+#include "cpuid.h"
+#include "msr.h"
+#include "relax.h"
+#include "timer.h"
+
+#define IA32_TSC_ADJUST 0x3bu
+#define IA32_TSC_AUX 0xc0000103u
+
+#define TSC_SYNC_ROUNDS 64
+
+/* what the BSP wants the AP under test to do next */
+enum {
+    TSC_CMD_IDLE = 0, // AP: done with the last one
+    TSC_CMD_MEASURE,
+    TSC_CMD_ADJUST,
+    TSC_CMD_DONE,
+};
+
+int64_t g_tsc_offset[MAX_CPUS];
+volatile uint8_t g_tsc_use_offsets;
+
+/* mailbox between the BSP and the one AP being checked */
+static struct {
+        uint32_t cmd;
+        uint32_t seq;    // odd: master stamp posted, even: answered
+        uint64_t master; // BSP TSC at the start of a round
+        uint64_t slave;  // AP TSC seen in that round
+        int64_t adjust;  // TSC_CMD_ADJUST: add to IA32_TSC_ADJUST
+} g_sync;
+
+static inline uint64_t rdtsc_ordered(void) {
+    lfence();
+    uint64_t t = _rdtsc();
+    lfence();
+    return t;
+}
+
+static int cpu_has_rdtscp(void) {
+    if (cpuid_max_ext_leaf() < 0x80000001u)
+        return 0;
+    return (cpuid(0x80000001u, 0).edx >> 27) & 1u;
+}
+
+static int cpu_has_tsc_adjust(void) {
+    if (cpuid_max_leaf() < 7)
+        return 0;
+    return (cpuid(7, 0).ebx >> 1) & 1u;
+}
+
+void tsc_sync_init_bsp(void) {
+    g_tsc_offset[0] = 0;
+    if (cpu_has_rdtscp())
+        wrmsr(IA32_TSC_AUX, 0);
+}
+
+static void sync_post(uint32_t cmd) {
+    __atomic_store_n(&g_sync.cmd, cmd, __ATOMIC_RELEASE);
+}
+
+static void sync_wait_idle(void) {
+    while (__atomic_load_n(&g_sync.cmd, __ATOMIC_ACQUIRE) != TSC_CMD_IDLE)
+        cpu_relax();
+}
+
+/*
+ * Ping-pong TSC stamps with the AP. A round brackets the AP's stamp
+ * between two of ours; assuming it was taken mid-way, the AP is
+ * off = slave - (master + rtt / 2) ahead, give or take rtt / 2. The
+ * round with the shortest trip bounds that best.
+ */
+static int64_t sync_measure(uint64_t *err) {
+    uint64_t best_rtt = UINT64_MAX;
+    int64_t off = 0;
+
+    sync_post(TSC_CMD_MEASURE);
+    for (uint32_t i = 0; i < TSC_SYNC_ROUNDS; i++) {
+        uint32_t seq = g_sync.seq + 1;
+        uint64_t t0 = rdtsc_ordered();
+        g_sync.master = t0;
+        __atomic_store_n(&g_sync.seq, seq, __ATOMIC_RELEASE);
+        while (__atomic_load_n(&g_sync.seq, __ATOMIC_ACQUIRE) == seq)
+            cpu_relax();
+        uint64_t t2 = rdtsc_ordered();
+
+        uint64_t rtt = t2 - t0;
+        if (rtt < best_rtt) {
+            best_rtt = rtt;
+            off = (int64_t)(g_sync.slave - t0 - rtt / 2);
+        }
+    }
+    sync_wait_idle();
+
+    *err = best_rtt / 2 + 1;
+    return off;
+}
+
+static inline uint64_t abs_i64(int64_t v) {
+    return v < 0 ? (uint64_t)-v : (uint64_t)v;
+}
+
+tsc_sync_result_t tsc_sync_source(uint32_t cpu) {
+    tsc_sync_result_t res = TSC_SYNC_OK;
+    uint64_t err;
+    int64_t off = sync_measure(&err);
+
+    if (abs_i64(off) > err && cpu_has_tsc_adjust()) {
+        // the AP writes its own MSR
+        g_sync.adjust = -off;
+        sync_post(TSC_CMD_ADJUST);
+        sync_wait_idle();
+        off = sync_measure(&err);
+        res = TSC_SYNC_ADJUSTED;
+    }
+
+    if (abs_i64(off) > err) {
+        // no (working) TSC_ADJUST; APs normally share the BSP's features
+        if (cpu_has_rdtscp()) {
+            g_tsc_offset[cpu] = -off;
+            __atomic_store_n(&g_tsc_use_offsets, 1, __ATOMIC_RELEASE);
+            timer_vclock_update();
+            res = TSC_SYNC_OFFSET;
+        } else {
+            res = TSC_SYNC_FAILED;
+        }
+    }
+
+    sync_post(TSC_CMD_DONE);
+    sync_wait_idle();
+    return res;
+}
+
+void tsc_sync_target(uint32_t cpu) {
+    for (;;) {
+        uint32_t cmd;
+        while ((cmd = __atomic_load_n(&g_sync.cmd, __ATOMIC_ACQUIRE)) ==
+               TSC_CMD_IDLE)
+            cpu_relax();
+
+        switch (cmd) {
+        case TSC_CMD_MEASURE:
+            for (uint32_t i = 0; i < TSC_SYNC_ROUNDS; i++) {
+                uint32_t seq;
+                while (!((seq = __atomic_load_n(&g_sync.seq,
+                                                __ATOMIC_ACQUIRE)) &
+                         1u))
+                    cpu_relax();
+                g_sync.slave = rdtsc_ordered();
+                __atomic_store_n(&g_sync.seq, seq + 1, __ATOMIC_RELEASE);
+            }
+            break;
+        case TSC_CMD_ADJUST:
+            wrmsr(IA32_TSC_ADJUST,
+                  rdmsr(IA32_TSC_ADJUST) + (uint64_t)g_sync.adjust);
+            break;
+        case TSC_CMD_DONE:
+            // read by tsc_read_synced() once offsets are in use
+            if (cpu_has_rdtscp())
+                wrmsr(IA32_TSC_AUX, cpu);
+            sync_post(TSC_CMD_IDLE);
+            return;
+        }
+        sync_post(TSC_CMD_IDLE);
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "cpu_local.h"
+#include "tsc.h"
+#include <stdint.h>
+#include <x86intrin.h>
+
+/*
+ * TSC agreement between cpus. Every AP is measured against the BSP while
+ * it comes up. An offset is corrected through IA32_TSC_ADJUST where the
+ * cpu has it; otherwise it is kept per cpu and added to every clock read.
+ * Reads find their cpu through RDTSCP's TSC_AUX, so they need no lock and
+ * no preemption guard. Agreement is to within half the measured round
+ * trip between the two cpus.
+ */
+typedef enum {
+    TSC_SYNC_OK = 0,   // already within the error bound
+    TSC_SYNC_ADJUSTED, // fixed through IA32_TSC_ADJUST
+    TSC_SYNC_OFFSET,   // corrected in software on every read
+    TSC_SYNC_FAILED,   // offset left in place, no way to correct it
+} tsc_sync_result_t;
+
+extern int64_t g_tsc_offset[MAX_CPUS];
+extern volatile uint8_t g_tsc_use_offsets;
+
+/* BSP, once the TSC is known to be usable */
+void tsc_sync_init_bsp(void);
+
+/*
+ * The two halves of the check, run at the same time with interrupts off:
+ * the BSP calls tsc_sync_source(cpu) while AP cpu calls tsc_sync_target().
+ */
+tsc_sync_result_t tsc_sync_source(uint32_t cpu);
+void tsc_sync_target(uint32_t cpu);
+
+/* TSC in the BSP's time base; ordered also fences it against later loads */
+static inline uint64_t tsc_read_synced(int ordered) {
+    uint64_t tsc;
+    if (!g_tsc_use_offsets) {
+        if (ordered)
+            lfence();
+        tsc = _rdtsc();
+    } else {
+        // RDTSCP waits for earlier instructions and names the cpu it ran on
+        uint32_t aux;
+        tsc = __rdtscp(&aux);
+        tsc += (uint64_t)g_tsc_offset[aux & (MAX_CPUS - 1)];
+    }
+    if (ordered)
+        lfence();
+    return tsc;
+}
@@ -0,0 +1,53 @@
+#include "dbgcon.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "../arch/x86_64/cpu/syscall.h"
+#include "print.h"
+#include "sched.h"
+
+/* keystrokes are rare, a poll costs two port reads */
+#define DBGCON_POLL_NS 50000000ull
+
+static void dbgcon_help(void) {
+    kprintln("[dbg] h: sched histograms  r: reset histograms  "
+             "t: thread stats  i: timer batching  s: syscalls");
+}
+
+void dbgcon_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int c;
+        while ((c = ktrygetc()) >= 0) {
+            switch (c) {
+            case 'h':
+                sched_dump_hist();
+                break;
+            case 'r':
+                sched_reset_hist();
+                kprintln("[dbg] histograms reset");
+                break;
+            case 't':
+                sched_dump_stats();
+                break;
+            case 'i': {
+                timerq_stats_t st;
+                uint64_t flags = cpu_irq_save();
+                timerq_get_stats(&st);
+                cpu_irq_restore(flags);
+                kprintlnf("[dbg] timers: %llu fired in %llu expiry passes",
+                          (unsigned long long)st.fired,
+                          (unsigned long long)st.batches);
+                break;
+            }
+            case 's':
+                syscall_dump_stats();
+                break;
+            case '?':
+                dbgcon_help();
+                break;
+            default:
+                break;
+            }
+        }
+        thread_sleep_ns(DBGCON_POLL_NS);
+    }
+}
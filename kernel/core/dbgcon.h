@@ -0,0 +1,11 @@
+#pragma once
+
+/*
+ * Serial debug console. A kernel thread polls COM1 and runs one-letter
+ * commands:
+ *
+ *   h  dump scheduler histograms    r  reset them
+ *   t  dump per-thread statistics   i  timer expiry batching
+ *   s  per-syscall counts and time  ?  list commands
+ */
+void dbgcon_main(void *arg);
@@ -0,0 +1,170 @@
+#include "futex.h"
+#include "../arch/x86_64/cpu/timer.h"
+#include "pmm.h"
+#include "sched.h"
+#include "spinlock.h"
+#include "uaccess.h"
+#include "vmm.h"
+#include <stddef.h>
+
+#define FUTEX_HASH_BITS 6
+#define FUTEX_HASH_SIZE (1u << FUTEX_HASH_BITS)
+
+typedef struct futex_key {
+        uint64_t space; // pml4 phys
+        uint64_t phys;
+} futex_key_t;
+
+typedef struct futex_waiter {
+        futex_key_t key;
+        thread_t *t;
+        struct futex_waiter *next;
+        uint8_t queued; // cleared by the waker that dequeued it
+        timer_event_t timeout;
+} futex_waiter_t;
+
+/* unrelated words that collide just share a list */
+typedef struct futex_bucket {
+        spinlock_t lock;
+        futex_waiter_t *head;
+        futex_waiter_t *tail;
+} futex_bucket_t;
+
+static futex_bucket_t g_buckets[FUTEX_HASH_SIZE];
+
+static int futex_key_of(uint64_t uaddr, futex_key_t *key) {
+    if (uaddr & 3)
+        return -1;
+    // aligned, so the word never straddles a page
+    if (uaccess_resolve(uaddr, 0, &key->phys) < 0)
+        return -1;
+    key->space = vmm_current_space().pml4_phys;
+    return 0;
+}
+
+static futex_bucket_t *futex_bucket(const futex_key_t *key) {
+    uint64_t h = (key->phys ^ (key->space >> 12)) * 0x9e3779b97f4a7c15ull;
+    return &g_buckets[h >> (64 - FUTEX_HASH_BITS)];
+}
+
+static inline int futex_key_eq(const futex_key_t *a, const futex_key_t *b) {
+    return a->space == b->space && a->phys == b->phys;
+}
+
+static void futex_append(futex_bucket_t *b, futex_waiter_t *w) {
+    w->next = NULL;
+    w->queued = 1;
+    if (b->tail)
+        b->tail->next = w;
+    else
+        b->head = w;
+    b->tail = w;
+}
+
+static void futex_unlink(futex_bucket_t *b, futex_waiter_t *prev,
+                         futex_waiter_t *w) {
+    if (prev)
+        prev->next = w->next;
+    else
+        b->head = w->next;
+    if (b->tail == w)
+        b->tail = prev;
+    w->queued = 0;
+}
+
+static void futex_remove(futex_bucket_t *b, futex_waiter_t *w) {
+    futex_waiter_t *prev = NULL;
+    for (futex_waiter_t *it = b->head; it; prev = it, it = it->next) {
+        if (it == w) {
+            futex_unlink(b, prev, w);
+            return;
+        }
+    }
+}
+
+static void futex_timeout_cb(void *arg) { sched_wakeup((thread_t *)arg); }
+
+int futex_wait(uint64_t uaddr, uint32_t expected, uint64_t timeout_ns) {
+    futex_key_t key;
+    if (futex_key_of(uaddr, &key) < 0)
+        return FUTEX_EFAULT;
+
+    thread_t *self = sched_current();
+    futex_bucket_t *b = futex_bucket(&key);
+    futex_waiter_t w = {.key = key, .t = self};
+    // 0 means no timeout: saturate rather than wrap into the past or onto 0
+    uint64_t deadline_ns = 0;
+    if (timeout_ns &&
+        __builtin_add_overflow(timer_now_ns(), timeout_ns, &deadline_ns))
+        deadline_ns = UINT64_MAX;
+
+    // read through the direct map: the user mapping is only known good as
+    // of the translation above
+    volatile uint32_t *word = (volatile uint32_t *)phys_to_virt(key.phys);
+
+    // irqs stay off from BLOCKED until schedule(), see waitq.c
+    uint64_t flags = spin_lock_irqsave(&b->lock);
+    if (*word != expected) {
+        spin_unlock_irqrestore(&b->lock, flags);
+        return FUTEX_EAGAIN;
+    }
+
+    futex_append(b, &w);
+    self->state = THREAD_BLOCKED;
+    self->block_reason = BLOCK_FUTEX;
+    spin_unlock(&b->lock);
+
+    if (deadline_ns) {
+        w.timeout.deadline_ns = deadline_ns;
+        w.timeout.slack_ns = TIMER_SLACK_TIMEOUT_NS;
+        w.timeout.cb = futex_timeout_cb;
+        w.timeout.arg = self;
+        timerq_insert(&w.timeout);
+    }
+
+    schedule();
+
+    if (deadline_ns)
+        timerq_cancel_sync(&w.timeout);
+
+    spin_lock(&b->lock);
+    int woken = !w.queued;
+    if (w.queued)
+        futex_remove(b, &w);
+    spin_unlock_irqrestore(&b->lock, flags);
+
+    if (!woken && deadline_ns && timer_now_ns() >= deadline_ns)
+        return FUTEX_ETIMEDOUT;
+    return 0;
+}
+
+int futex_wake(uint64_t uaddr, uint32_t n) {
+    futex_key_t key;
+    if (futex_key_of(uaddr, &key) < 0)
+        return FUTEX_EFAULT;
+    return futex_wake_phys(key.space, key.phys, n);
+}
+
+int futex_wake_phys(uint64_t space, uint64_t phys, uint32_t n) {
+    futex_key_t key = {.space = space, .phys = phys};
+    futex_bucket_t *b = futex_bucket(&key);
+    int woken = 0;
+
+    // wake under the bucket lock: waiters live on their own stacks
+    uint64_t flags = spin_lock_irqsave(&b->lock);
+    futex_waiter_t *prev = NULL;
+    futex_waiter_t *w = b->head;
+    while (w && (uint32_t)woken < n) {
+        futex_waiter_t *next = w->next;
+        if (futex_key_eq(&w->key, &key)) {
+            futex_unlink(b, prev, w);
+            sched_wakeup(w->t);
+            woken++;
+        } else {
+            prev = w;
+        }
+        w = next;
+    }
+    spin_unlock_irqrestore(&b->lock, flags);
+    return woken;
+}
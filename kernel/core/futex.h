@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Futexes: user space keeps its locks and condition variables in plain
+ * 32-bit words and only enters the kernel to sleep when contended.
+ * Waiters are keyed by (address space, physical address), so the same
+ * word is found whichever virtual alias it is reached through.
+ */
+
+#define FUTEX_EFAULT (-1)    // bad or unaligned address
+#define FUTEX_EAGAIN (-2)    // *uaddr != expected on entry
+#define FUTEX_ETIMEDOUT (-3) // timeout expired before a wake
+
+/*
+ * Sleep if *uaddr still holds expected, until futex_wake() on the same
+ * word or timeout_ns (relative, 0 = forever) passes. The value check and
+ * the enqueue are atomic with respect to futex_wake(). Returns 0 when
+ * woken; as with any condition wait, callers re-check their predicate.
+ */
+int futex_wait(uint64_t uaddr, uint32_t expected, uint64_t timeout_ns);
+
+/* wake up to n waiters on uaddr, oldest first; returns how many or < 0 */
+int futex_wake(uint64_t uaddr, uint32_t n);
+
+/*
+ * futex_wake() on a word already resolved to (address space, physical
+ * address), from any context; for the kernel posting to user words.
+ */
+int futex_wake_phys(uint64_t space, uint64_t phys, uint32_t n);
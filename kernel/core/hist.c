@@ -0,0 +1,59 @@
+#include "hist.h"
+#include "print.h"
+#include <stddef.h>
+
+void hist_reset(hist_t *h) {
+    for (uint32_t i = 0; i < HIST_BUCKETS; i++)
+        h->count[i] = 0;
+    h->total = 0;
+    h->max = 0;
+}
+
+uint64_t hist_bucket_low(uint32_t b) {
+    if (b < HIST_SUB_COUNT)
+        return b;
+    uint32_t e = b / HIST_SUB_COUNT + HIST_SUB_BITS - 1;
+    uint64_t sub = b % HIST_SUB_COUNT;
+    return (HIST_SUB_COUNT + sub) << (e - HIST_SUB_BITS);
+}
+
+uint64_t hist_percentile(const hist_t *h, uint32_t per_mille) {
+    if (!h->total)
+        return 0;
+
+    // rank of the wanted sample, 1-based, rounded up
+    uint64_t rank = (h->total * per_mille + 999) / 1000;
+    if (!rank)
+        rank = 1;
+
+    uint64_t seen = 0;
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->count[b];
+        if (seen >= rank)
+            return hist_bucket_low(b);
+    }
+    return h->max;
+}
+
+/* as printed: %llu wants unsigned long long, not uint64_t */
+static inline unsigned long long hist_conv(uint64_t (*conv)(uint64_t),
+                                           uint64_t v) {
+    return conv ? conv(v) : v;
+}
+
+void hist_dump(const char *name, const hist_t *h, uint64_t (*conv)(uint64_t)) {
+    kprintlnf("%s: n=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu",
+              name, (unsigned long long)h->total,
+              hist_conv(conv, hist_percentile(h, 500)),
+              hist_conv(conv, hist_percentile(h, 900)),
+              hist_conv(conv, hist_percentile(h, 990)),
+              hist_conv(conv, hist_percentile(h, 999)),
+              hist_conv(conv, h->max));
+
+    for (uint32_t b = 0; b < HIST_BUCKETS; b++) {
+        if (!h->count[b])
+            continue;
+        kprintlnf("  >= %llu: %llu", hist_conv(conv, hist_bucket_low(b)),
+                  (unsigned long long)h->count[b]);
+    }
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Log-linear ("HDR") histogram: every power of two is split into
+ * 2^HIST_SUB_BITS linear buckets, so any value is known to within 12.5%
+ * from 1 up to 2^HIST_MAX_EXP, with a fixed 2.7 KiB footprint. Recording
+ * is a clz, a shift and an increment; the caller provides exclusion.
+ */
+
+#define HIST_SUB_BITS 3u
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+#define HIST_MAX_EXP 44u // larger values land in the last bucket
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+typedef struct hist {
+        uint64_t count[HIST_BUCKETS];
+        uint64_t total;
+        uint64_t max;
+} hist_t;
+
+static inline uint32_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB_COUNT)
+        return (uint32_t)v;
+
+    uint32_t e = 63u - (uint32_t)__builtin_clzll(v);
+    if (e >= HIST_MAX_EXP)
+        return HIST_BUCKETS - 1;
+
+    uint32_t sub = (uint32_t)(v >> (e - HIST_SUB_BITS)) & (HIST_SUB_COUNT - 1);
+    return (e - HIST_SUB_BITS + 1) * HIST_SUB_COUNT + sub;
+}
+
+static inline void hist_record(hist_t *h, uint64_t v) {
+    h->count[hist_bucket(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+void hist_reset(hist_t *h);
+
+/* smallest value that lands in bucket b */
+uint64_t hist_bucket_low(uint32_t b);
+
+/* lower bound of the bucket holding the per_mille'th value, 0 if empty */
+uint64_t hist_percentile(const hist_t *h, uint32_t per_mille);
+
+/*
+ * Print percentiles and the non-empty buckets. conv maps recorded values
+ * to the printed unit (e.g. tsc ticks to ns), NULL to print them as is.
+ */
+void hist_dump(const char *name, const hist_t *h, uint64_t (*conv)(uint64_t));
@@ -0,0 +1,131 @@
+#include "klog.h"
+#include "../arch/x86_64/cpu/cpu_local.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "pmm.h"
+#include "print.h"
+#include "uaccess.h"
+#include "waitq.h"
+
+#define KLOG_RING_MASK (KLOG_RING_SIZE - 1)
+#define KLOG_RING_PAGES (KLOG_RING_SIZE / 4096u)
+#define KLOG_SYNC_CHUNK 128u
+
+/*
+ * Single producer (the owning cpu, interrupts off) and single consumer
+ * (klogd); head and tail only ever grow.
+ */
+typedef struct klog_ring {
+        char *buf;
+        uint64_t head;    // next byte to write
+        uint64_t tail;    // next byte to drain
+        uint64_t dropped; // bytes clipped since the last report
+} klog_ring_t;
+
+static klog_ring_t g_rings[MAX_CPUS];
+static waitq_t g_klogd_wq = WAITQ_INIT;
+
+int klog_init_cpu(uint32_t cpu) {
+    void *phys = pmm_alloc_pages(KLOG_RING_PAGES);
+    if (!phys)
+        return -1;
+    __atomic_store_n(&g_rings[cpu].buf, (char *)phys_to_virt((uint64_t)phys),
+                     __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* no ring yet: bounce through the stack and print in place */
+static int64_t klog_write_sync(uint64_t ubuf, uint64_t len) {
+    char tmp[KLOG_SYNC_CHUNK];
+    for (uint64_t done = 0; done < len;) {
+        uint64_t n = len - done;
+        if (n > sizeof(tmp))
+            n = sizeof(tmp);
+        if (copy_from_user(tmp, ubuf + done, n) < 0)
+            return -1;
+        kwrite(tmp, n);
+        done += n;
+    }
+    return (int64_t)len;
+}
+
+int64_t klog_write_user(uint64_t ubuf, uint64_t len) {
+    if (!uaccess_range_ok(ubuf, len))
+        return -1;
+    if (!len)
+        return 0;
+
+    // interrupts off: nothing else on this cpu touches its ring meanwhile
+    uint64_t flags = cpu_irq_save();
+    klog_ring_t *r = &g_rings[this_cpu_id()];
+    if (!r->buf) {
+        cpu_irq_restore(flags);
+        return klog_write_sync(ubuf, len);
+    }
+
+    uint64_t head = r->head;
+    uint64_t room =
+        KLOG_RING_SIZE - (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+    uint64_t n = len < room ? len : room;
+
+    // at most two pieces: up to the end of the ring, then from its start
+    uint64_t off = head & KLOG_RING_MASK;
+    uint64_t first = KLOG_RING_SIZE - off;
+    if (first > n)
+        first = n;
+    if (copy_from_user(r->buf + off, ubuf, first) < 0 ||
+        copy_from_user(r->buf, ubuf + first, n - first) < 0) {
+        cpu_irq_restore(flags);
+        return -1;
+    }
+
+    __atomic_store_n(&r->head, head + n, __ATOMIC_RELEASE);
+    if (n < len)
+        __atomic_fetch_add(&r->dropped, len - n, __ATOMIC_RELAXED);
+    cpu_irq_restore(flags);
+
+    if (n)
+        waitq_wake_one(&g_klogd_wq);
+    return (int64_t)n;
+}
+
+static int klog_pending(void *arg) {
+    (void)arg;
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        const klog_ring_t *r = &g_rings[cpu];
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+            return 1;
+    }
+    return 0;
+}
+
+static void klog_drain(klog_ring_t *r) {
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = r->tail;
+
+    while (tail != head) {
+        uint64_t off = tail & KLOG_RING_MASK;
+        uint64_t n = head - tail;
+        if (n > KLOG_RING_SIZE - off)
+            n = KLOG_RING_SIZE - off;
+        // straight from the ring to the port
+        kwrite(r->buf + off, n);
+        tail += n;
+        // hand the space back as soon as it is out
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    uint64_t dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        kprintlnf("\n[klog] %llu bytes dropped", (unsigned long long)dropped);
+}
+
+void klogd_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        waitq_wait(&g_klogd_wq, klog_pending, 0);
+        for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+            if (g_rings[cpu].buf)
+                klog_drain(&g_rings[cpu]);
+        }
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Buffered console output for user space. Writers copy into a ring of the
+ * cpu they run on and return; the klogd thread drains the rings to the
+ * serial port in bulk. Output of one cpu stays in order, output of
+ * different cpus may interleave at write granularity. A write that does
+ * not fit in the free space of the ring is clipped and the excess is
+ * reported as dropped.
+ */
+
+#define KLOG_RING_SIZE (16u * 1024u) // per cpu, power of two
+
+/* give cpu its ring; until then its writes go out synchronously */
+int klog_init_cpu(uint32_t cpu);
+
+/* returns the bytes accepted, or -1 for a bad user range */
+int64_t klog_write_user(uint64_t ubuf, uint64_t len);
+
+void klogd_main(void *arg);
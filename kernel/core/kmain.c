@@ -1,19 +1,26 @@
 #include <stdint.h>
 
 #include "../arch/x86_64/cpu/cpu_local.h"
+#include "../arch/x86_64/cpu/fpu.h"
 #include "../arch/x86_64/cpu/gdt.h"
 #include "../arch/x86_64/cpu/idt.h"
 #include "../arch/x86_64/cpu/irq.h"
 #include "../arch/x86_64/cpu/lapic.h"
+#include "../arch/x86_64/cpu/relax.h"
 #include "../arch/x86_64/cpu/syscall.h"
 #include "../arch/x86_64/cpu/timer.h"
+#include "../arch/x86_64/cpu/topology.h"
 
+#include "../mm/kstack.h"
 #include "../mm/pmm.h"
 #include "../mm/vmm.h"
 
+#include "../acpi/acpi.h"
 #include "../boot/boot_info.h"
 
 #include "core/panic.h"
+#include "dbgcon.h"
+#include "klog.h"
 #include "lapic.h"
 #include "print.h"
 #include "sched.h"
@@ -72,6 +79,7 @@ __attribute__((noreturn)) static void enter_user(uint64_t user_rip,
                      "or qword ptr [rsp], 0x200\n"
                      "push %c3\n"
                      "push rdi\n"
+                     "swapgs\n"
                      "iretq\n"
                      ".att_syntax prefix\n"
                      :
@@ -82,8 +90,11 @@ __attribute__((noreturn)) static void enter_user(uint64_t user_rip,
         __asm__ volatile("hlt");
 }
 
+static thread_t idle0;
 static thread_t t0;
 static thread_t t1;
+static thread_t dbgcon;
+static thread_t klogd;
 
 void kmain(void) {
     // =========================================================================
@@ -103,6 +114,13 @@ void kmain(void) {
     kprintln("[init] gdt");
     gdt_init(); // installs known selectors for kernel + user
 
+    // GS -> cpu_local from here on; preempt counts live there
+    cpu_local_init(&g_cpu_local, 0);
+    topology_init_cpu(0);
+    kprintlnf("[cpu] apic=%u smt=%u core=%u pkg=%u", topology_of(0)->apic_id,
+              topology_of(0)->smt_id, topology_of(0)->core_id,
+              topology_of(0)->pkg_id);
+
     // =========================================================================
     // 2) BOOT INFO: grab Limine-provided data while it's valid
     // =========================================================================
@@ -123,6 +141,14 @@ void kmain(void) {
     kprintln("[init] vmm");
     vmm_init();
 
+    kprintln("[init] kstack");
+    kstack_init();
+
+    kprintln("[init] fpu");
+    fpu_init();
+    kprintlnf("[fpu] mode=%u area=%u bytes", (unsigned)fpu_save_mode(),
+              (unsigned)fpu_state_size());
+
     // TODO: build and switch to kernel-owned page tables (own CR3)
     //      - keep HHDM mapping
     //      - map kernel higher-half RX/RO/RW properly
@@ -139,28 +165,27 @@ void kmain(void) {
         // TODO: when SMP: allocate cpu_local per core + set
         // MSR_KERNEL_GS_BASE per core
 
-        kprintln("df_stack");
-        void *df_stack = pmm_alloc_pages(2);
-        gdt_set_ist(1, (uint64_t)phys_to_virt((uint64_t)df_stack + 2 * 4096));
-
-        kprintln("alloc pf stack");
-        void *pf_stack = pmm_alloc_pages(2);
-        gdt_set_ist(2, (uint64_t)phys_to_virt((uint64_t)pf_stack + 2 * 4096));
-
-        kprintln("alloc nmi stack");
-        void *nmi_stack = pmm_alloc_pages(2);
-        gdt_set_ist(3, (uint64_t)phys_to_virt((uint64_t)nmi_stack + 2 * 4096));
-        // TODO: allocate per-cpu kernel stacks and store in cpu_local via GS
-        // base
-        // For now: single-core bootstrap
-
-        void *kstack0 = pmm_alloc_pages(2);
-        void *kstack1 = pmm_alloc_pages(2);
-
-        uint64_t kstack0_top =
-            (uint64_t)phys_to_virt((uint64_t)kstack0 + 2 * 4096);
-        uint64_t kstack1_top =
-            (uint64_t)phys_to_virt((uint64_t)kstack1 + 2 * 4096);
+        // all guarded stacks from the kstack region; #PF gets its own so a
+        // stack overflow can still be reported
+        uint64_t df_stack_top = kstack_alloc();
+        uint64_t pf_stack_top = kstack_alloc();
+        uint64_t nmi_stack_top = kstack_alloc();
+        uint64_t irq_stack_top = kstack_alloc();
+        if (!df_stack_top || !pf_stack_top || !nmi_stack_top || !irq_stack_top)
+            panic("cpu stack allocation failed");
+
+        gdt_set_ist(1, df_stack_top);
+        gdt_set_ist(2, pf_stack_top);
+        gdt_set_ist(3, nmi_stack_top);
+        g_cpu_local.irq_stack_top = irq_stack_top;
+
+        uint64_t kstack0_top = kstack_alloc();
+        uint64_t kstack1_top = kstack_alloc();
+        uint64_t dbgcon_stack_top = kstack_alloc();
+        uint64_t klogd_stack_top = kstack_alloc();
+        if (!kstack0_top || !kstack1_top || !dbgcon_stack_top ||
+            !klogd_stack_top)
+            panic("thread stack allocation failed");
 
         // map two user stacks and two code pages
         uint64_t user_code0 = 0x0000000000400000ull;
@@ -189,19 +214,33 @@ void kmain(void) {
         thread_init_user(&t0, user_code0, user_stack0 + 4096, kstack0_top);
         kprintln("thread 2");
         thread_init_user(&t1, user_code1, user_stack1 + 4096, kstack1_top);
+        thread_init_kernel(&dbgcon, dbgcon_main, 0, dbgcon_stack_top);
+        thread_init_kernel(&klogd, klogd_main, 0, klogd_stack_top);
+        if (klog_init_cpu(0) < 0)
+            kprintln("[klog] no ring, user output stays synchronous");
 
         g_cpu_local.kernel_rsp = kstack0_top;
         gdt_set_kernel_stack(kstack0_top);
 
+        // kmain itself carries on as the BSP idle thread
         kprintln("[init] sched");
-        sched_init(&t0);
+        sched_init(&idle0);
 
+        sched_add(&t0);
         sched_add(&t1);
+        sched_add(&dbgcon);
+        sched_add(&klogd);
 
         kprintln("[init] idt");
         idt_init();
         irq_init();
 
+        kprintln("[init] acpi");
+        if (acpi_init())
+            kprintln("[acpi] no rsdp");
+        else
+            kprintlnf("[acpi] revision %u", acpi_revision());
+
         kprintln("[init] timer");
         timer_init(TIMER_VECTOR);
 
@@ -212,16 +251,27 @@ void kmain(void) {
             kprintln("[timer] lapic oneshot");
         else
             panic("timer init failed");
+        kprintlnf("[timer] tsc %llu kHz via %s",
+                  (unsigned long long)(timer_tsc_hz() / 1000),
+                  timer_calib_method());
+        kprintlnf("[lapic] %s id=%u",
+                  lapic_mode() == LAPIC_MODE_X2APIC ? "x2apic" : "xapic",
+                  lapic_id());
+
+        cpu_relax_init(0);
+
+        kprintln("[init] syscall");
+        syscall_init();
 
         irq_register_vector_handler(timer_vector(), sched_on_tick);
+        irq_register_vector_handler(LAPIC_RESCHED_VECTOR, sched_on_ipi);
         sched_set_quantum_ns(SCHED_QUANTUM_NS);
         sched_start();
 
         idt_enable();
-        kprintln("[init] syscall");
-        syscall_init();
 
-        enter_user(user_code0, user_stack0 + 4096);
+        kprintln("[init] kernel idle");
+        sched_idle();
     }
 
     // =========================================================================
@@ -245,10 +295,7 @@ void kmain(void) {
     // =========================================================================
     // 7) SCHEDULER + THREADS: make the kernel a runtime
     // =========================================================================
-    // TODO: kernel thread primitive (kthread)
-    // TODO: context switch (save/restore regs, FPU state later)
     // TODO: run queue + priorities (desktop: latency aware)
-    // TODO: preemption boundaries (kernel critical sections)
 
     // =========================================================================
     // 8) USERMODE BRING-UP: create init process
@@ -0,0 +1,212 @@
+#include "mutex.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "../arch/x86_64/cpu/relax.h"
+#include "panic.h"
+#include "preempt.h"
+#include "spinlock.h"
+#include <stddef.h>
+
+#define MUTEX_HAS_WAITERS ((uintptr_t)1)
+
+/* bound on PI chain walks; longer chains are almost certainly deadlocks */
+#define MUTEX_PI_MAX_DEPTH 16
+
+/*
+ * One lock for every contended path: waiter lists, blocked_on and the PI
+ * donors. Fast paths never touch it. Order: g_pi_lock, then queue locks.
+ */
+static spinlock_t g_pi_lock = SPINLOCK_INIT;
+
+static inline int owner_cas(mutex_t *m, uintptr_t old, uintptr_t new) {
+    return __atomic_compare_exchange_n(&m->owner, &old, new, 0,
+                                       __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void mutex_init(mutex_t *m) {
+    m->owner = 0;
+    m->waiters = NULL;
+    m->held_next = NULL;
+}
+
+/* held lists are only touched by their owner */
+static void held_push(thread_t *t, mutex_t *m) {
+    m->held_next = t->held;
+    t->held = m;
+}
+
+static void held_remove(thread_t *t, mutex_t *m) {
+    for (mutex_t **pp = &t->held; *pp; pp = &(*pp)->held_next) {
+        if (*pp == m) {
+            *pp = m->held_next;
+            m->held_next = NULL;
+            return;
+        }
+    }
+}
+
+/* behind all waiters of equal priority, so equals stay FIFO */
+static void waiter_insert(mutex_t *m, mutex_waiter_t *w) {
+    mutex_waiter_t **pp = &m->waiters;
+    while (*pp && !sched_prio_higher(w->t, (*pp)->t))
+        pp = &(*pp)->next;
+    w->next = *pp;
+    *pp = w;
+}
+
+static mutex_waiter_t *waiter_unlink(mutex_t *m, thread_t *t) {
+    for (mutex_waiter_t **pp = &m->waiters; *pp; pp = &(*pp)->next) {
+        if ((*pp)->t == t) {
+            mutex_waiter_t *w = *pp;
+            *pp = w->next;
+            return w;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * m gained a waiter: boost its owner if that waiter outranks it, and keep
+ * going while the boosted owner is itself waiting on a mutex.
+ */
+static void pi_propagate(mutex_t *m) {
+    for (int depth = 0; m && depth < MUTEX_PI_MAX_DEPTH; depth++) {
+        thread_t *owner = mutex_owner(m);
+        if (!owner || !m->waiters)
+            return;
+
+        thread_t *top = m->waiters->t;
+        if (!sched_prio_higher(top, owner))
+            return;
+        sched_pi_boost(owner, top);
+
+        // owner's position among its own mutex's waiters just moved up
+        m = owner->blocked_on;
+        if (m) {
+            mutex_waiter_t *w = waiter_unlink(m, owner);
+            if (w)
+                waiter_insert(m, w);
+        }
+    }
+}
+
+/* best waiter over everything t still holds, or NULL */
+static thread_t *pi_top_donor(thread_t *t) {
+    thread_t *best = NULL;
+    for (mutex_t *h = t->held; h; h = h->held_next) {
+        if (h->waiters && (!best || sched_prio_higher(h->waiters->t, best)))
+            best = h->waiters->t;
+    }
+    return best;
+}
+
+int mutex_trylock(mutex_t *m) {
+    thread_t *self = sched_current();
+    if (!owner_cas(m, 0, (uintptr_t)self))
+        return 0;
+    held_push(self, m);
+    return 1;
+}
+
+/*
+ * Spin while the owner is running: its critical section is likely short
+ * and sleeping would cost two context switches. Returns 1 if m was taken.
+ */
+static int mutex_spin(mutex_t *m, thread_t *self) {
+    preempt_disable();
+    for (;;) {
+        uintptr_t v = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        if (!v) {
+            if (owner_cas(m, 0, (uintptr_t)self)) {
+                preempt_enable();
+                return 1;
+            }
+            continue;
+        }
+
+        thread_t *owner = (thread_t *)(v & ~MUTEX_HAS_WAITERS);
+        if (owner == self)
+            panic("mutex: recursive lock");
+        if (!owner->on_cpu || owner->state != THREAD_RUNNING ||
+            need_resched())
+            break;
+        cpu_relax();
+    }
+    preempt_enable();
+    return 0;
+}
+
+void mutex_lock(mutex_t *m) {
+    thread_t *self = sched_current();
+
+    if (owner_cas(m, 0, (uintptr_t)self) || mutex_spin(m, self)) {
+        held_push(self, m);
+        return;
+    }
+
+    uint64_t flags = spin_lock_irqsave(&g_pi_lock);
+
+    // flag the owner word so the owner takes the slow unlock path; if it
+    // was released meanwhile just take it
+    for (;;) {
+        uintptr_t v = __atomic_load_n(&m->owner, __ATOMIC_RELAXED);
+        if (!v) {
+            if (owner_cas(m, 0, (uintptr_t)self)) {
+                spin_unlock_irqrestore(&g_pi_lock, flags);
+                held_push(self, m);
+                return;
+            }
+            continue;
+        }
+        if ((v & MUTEX_HAS_WAITERS) || owner_cas(m, v, v | MUTEX_HAS_WAITERS))
+            break;
+    }
+
+    mutex_waiter_t w = {.t = self};
+    waiter_insert(m, &w);
+    self->blocked_on = m;
+    pi_propagate(m);
+
+    // unlock hands ownership over before waking us
+    while (mutex_owner(m) != self) {
+        self->state = THREAD_BLOCKED;
+        self->block_reason = BLOCK_MUTEX;
+        spin_unlock(&g_pi_lock);
+        schedule(); // irqs still off: no preemption while BLOCKED
+        spin_lock(&g_pi_lock);
+    }
+
+    spin_unlock_irqrestore(&g_pi_lock, flags);
+    held_push(self, m);
+}
+
+void mutex_unlock(mutex_t *m) {
+    thread_t *self = sched_current();
+
+    held_remove(self, m);
+    if (owner_cas(m, (uintptr_t)self, 0))
+        return;
+
+    uint64_t flags = spin_lock_irqsave(&g_pi_lock);
+
+    mutex_waiter_t *w = m->waiters;
+    if (w) {
+        m->waiters = w->next;
+        w->t->blocked_on = NULL;
+        uintptr_t v = (uintptr_t)w->t | (m->waiters ? MUTEX_HAS_WAITERS : 0);
+        __atomic_store_n(&m->owner, v, __ATOMIC_RELEASE);
+        // the new owner inherits from whoever is still waiting
+        pi_propagate(m);
+    } else {
+        __atomic_store_n(&m->owner, 0, __ATOMIC_RELEASE);
+    }
+
+    // drop whatever we inherited through m
+    thread_t *donor = pi_top_donor(self);
+    if (donor != self->pi_donor)
+        sched_pi_boost(self, donor);
+
+    if (w)
+        sched_wakeup(w->t);
+
+    spin_unlock_irqrestore(&g_pi_lock, flags);
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include "sched.h"
+#include <stdint.h>
+
+/*
+ * Sleeping mutex with priority inheritance.
+ *
+ * Uncontended lock/unlock is a single cmpxchg on the owner word. Under
+ * contention a locker spins while the owner is on a cpu (it will likely
+ * let go soon) and sleeps otherwise. Sleepers are kept in priority order;
+ * the owner runs with the priority of the best of them, transitively
+ * through chains of owners that are themselves blocked. Unlock hands the
+ * mutex straight to the top waiter, so nobody else can barge in and
+ * exactly one thread is woken.
+ *
+ * Not for interrupt context.
+ */
+
+typedef struct mutex_waiter {
+        thread_t *t;
+        struct mutex_waiter *next;
+} mutex_waiter_t;
+
+typedef struct mutex {
+        volatile uintptr_t owner; // thread_t *, bit 0: waiters present
+        mutex_waiter_t *waiters;  // best effective priority first
+        struct mutex *held_next;  // link in the owner's held list
+} mutex_t;
+
+#define MUTEX_INIT {0, 0, 0}
+
+void mutex_init(mutex_t *m);
+void mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m); // 1 if acquired
+void mutex_unlock(mutex_t *m);
+
+static inline thread_t *mutex_owner(const mutex_t *m) {
+    return (thread_t *)(m->owner & ~(uintptr_t)1);
+}
@@ -0,0 +1,73 @@
+#pragma once
+#include "../arch/x86_64/cpu/cpu_local.h"
+#include <stdint.h>
+
+/*
+ * Kernel preemption control.
+ *
+ * Code that must not be switched out (per-cpu data, short global critical
+ * sections that do not need interrupts off) brackets itself with
+ * preempt_disable()/preempt_enable(). Sections nest. A reschedule requested
+ * while the count is raised is deferred to the outermost preempt_enable()
+ * or to the next return from interrupt, whichever comes first.
+ *
+ * Interrupts-off regions are implicitly non-preemptible.
+ */
+
+#define preempt_barrier() __asm__ volatile("" ::: "memory")
+
+void preempt_schedule(void);
+
+/*
+ * The count and flag are touched with single GS-relative instructions:
+ * going through this_cpu() would be a load and a separate update, and an
+ * interrupt in between may preempt and migrate the thread, leaving it to
+ * update another cpu's count.
+ */
+static inline uint32_t preempt_count(void) {
+    uint32_t n;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov %0, dword ptr gs:[16]\n"
+                     ".att_syntax prefix\n"
+                     : "=r"(n));
+    return n;
+}
+
+static inline int need_resched(void) {
+    uint32_t r;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "mov %0, dword ptr gs:[20]\n"
+                     ".att_syntax prefix\n"
+                     : "=r"(r));
+    return r != 0;
+}
+
+static inline void preempt_disable(void) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "inc dword ptr gs:[16]\n"
+                     ".att_syntax prefix\n"
+                     :
+                     :
+                     : "memory", "cc");
+}
+
+static inline void preempt_enable_no_resched(void) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "dec dword ptr gs:[16]\n"
+                     ".att_syntax prefix\n"
+                     :
+                     :
+                     : "memory", "cc");
+}
+
+static inline void preempt_enable(void) {
+    preempt_enable_no_resched();
+    if (!preempt_count() && need_resched())
+        preempt_schedule();
+}
+
+/* explicit preemption point for long loops outside critical sections */
+static inline void cond_resched(void) {
+    if (!preempt_count() && need_resched())
+        preempt_schedule();
+}
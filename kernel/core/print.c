@@ -150,6 +150,35 @@ void kputc(char c) {
                      : "a"(c), "d"(0x3f8));
 }
 
+void kwrite(const char *s, uint64_t len) {
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "rep outsb\n"
+                     ".att_syntax prefix\n"
+                     : "+S"(s), "+c"(len)
+                     : "d"(0x3f8)
+                     : "memory");
+}
+
+#define COM1_LSR 0x3fd
+#define LSR_DATA_READY 0x01
+
+int ktrygetc(void) {
+    uint8_t lsr, c;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "in al, dx\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(lsr)
+                     : "d"(COM1_LSR));
+    if (!(lsr & LSR_DATA_READY))
+        return -1;
+    __asm__ volatile(".intel_syntax noprefix\n"
+                     "in al, dx\n"
+                     ".att_syntax prefix\n"
+                     : "=a"(c)
+                     : "d"(0x3f8));
+    return c;
+}
+
 void kprint(const char *s) {
     while (*s) {
         kputc((uint8_t)*s++);
@@ -3,11 +3,17 @@
 #include <stdint.h>
 
 void kputc(char c);
+/* next byte received on the console, -1 if none; never blocks */
+int ktrygetc(void);
 void kputs(const char *s);
+/* len raw bytes in one string output, NULs included */
+void kwrite(const char *s, uint64_t len);
 
-void kprintf(const char *fmt, ...);
-void kvprintf(const char *fmt, va_list args);
-void kprintlnf(const char *fmt, ...);
+/* %c %s %d %i %u %x %X %p %llu %llx, optional 0 flag and width */
+void kprintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void kvprintf(const char *fmt, va_list args)
+    __attribute__((format(printf, 1, 0)));
+void kprintlnf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
 void kprint(const char *s);
 void kprintln(const char *s);
@@ -0,0 +1,278 @@
+#include "rbtree.h"
+
+#define RB_RED 0
+#define RB_BLACK 1
+
+static inline int is_red(const rb_node_t *n) { return n && n->color == RB_RED; }
+
+static void rotate_left(rb_root_t *root, rb_node_t *x) {
+    rb_node_t *y = x->right;
+
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+
+    y->parent = x->parent;
+    if (!x->parent)
+        root->node = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(rb_root_t *root, rb_node_t *x) {
+    rb_node_t *y = x->left;
+
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+
+    y->parent = x->parent;
+    if (!x->parent)
+        root->node = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+
+    y->right = x;
+    x->parent = y;
+}
+
+static void insert_fixup(rb_root_t *root, rb_node_t *z) {
+    rb_node_t *p;
+
+    while ((p = z->parent) && p->color == RB_RED) {
+        rb_node_t *g = p->parent; // p is red, so never the root
+
+        if (p == g->left) {
+            rb_node_t *u = g->right;
+            if (is_red(u)) {
+                p->color = RB_BLACK;
+                u->color = RB_BLACK;
+                g->color = RB_RED;
+                z = g;
+                continue;
+            }
+            if (z == p->right) {
+                rotate_left(root, p);
+                z = p;
+                p = z->parent;
+            }
+            p->color = RB_BLACK;
+            g->color = RB_RED;
+            rotate_right(root, g);
+        } else {
+            rb_node_t *u = g->left;
+            if (is_red(u)) {
+                p->color = RB_BLACK;
+                u->color = RB_BLACK;
+                g->color = RB_RED;
+                z = g;
+                continue;
+            }
+            if (z == p->left) {
+                rotate_right(root, p);
+                z = p;
+                p = z->parent;
+            }
+            p->color = RB_BLACK;
+            g->color = RB_RED;
+            rotate_left(root, g);
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+/* link node below parent; returns nonzero if node became the leftmost */
+static int link_node(rb_root_t *root, rb_node_t *node, rb_less_t less) {
+    rb_node_t **link = &root->node;
+    rb_node_t *parent = 0;
+    int leftmost = 1;
+
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = 0;
+        }
+    }
+
+    node->parent = parent;
+    node->left = 0;
+    node->right = 0;
+    node->color = RB_RED;
+    *link = node;
+    return leftmost;
+}
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_less_t less) {
+    link_node(root, node, less);
+    insert_fixup(root, node);
+}
+
+static void transplant(rb_root_t *root, rb_node_t *u, rb_node_t *v) {
+    if (!u->parent)
+        root->node = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+/* x may be NULL (a leaf), hence the explicit parent */
+static void erase_fixup(rb_root_t *root, rb_node_t *x, rb_node_t *parent) {
+    while (x != root->node && !is_red(x)) {
+        if (x == parent->left) {
+            rb_node_t *w = parent->right;
+            if (is_red(w)) {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                w = parent->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->right)) {
+                w->left->color = RB_BLACK;
+                w->color = RB_RED;
+                rotate_right(root, w);
+                w = parent->right;
+            }
+            w->color = parent->color;
+            parent->color = RB_BLACK;
+            w->right->color = RB_BLACK;
+            rotate_left(root, parent);
+            x = root->node;
+            break;
+        } else {
+            rb_node_t *w = parent->left;
+            if (is_red(w)) {
+                w->color = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                w = parent->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->color = RB_RED;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->left)) {
+                w->right->color = RB_BLACK;
+                w->color = RB_RED;
+                rotate_left(root, w);
+                w = parent->left;
+            }
+            w->color = parent->color;
+            parent->color = RB_BLACK;
+            w->left->color = RB_BLACK;
+            rotate_right(root, parent);
+            x = root->node;
+            break;
+        }
+    }
+    if (x)
+        x->color = RB_BLACK;
+}
+
+void rb_erase(rb_root_t *root, rb_node_t *z) {
+    rb_node_t *x;
+    rb_node_t *x_parent;
+    uint8_t removed_color = z->color;
+
+    if (!z->left) {
+        x = z->right;
+        x_parent = z->parent;
+        transplant(root, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        x_parent = z->parent;
+        transplant(root, z, z->left);
+    } else {
+        rb_node_t *y = z->right;
+        while (y->left)
+            y = y->left;
+
+        removed_color = y->color;
+        x = y->right;
+
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            transplant(root, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+
+        transplant(root, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->color = z->color;
+    }
+
+    if (removed_color == RB_BLACK)
+        erase_fixup(root, x, x_parent);
+
+    z->parent = z->left = z->right = 0;
+}
+
+rb_node_t *rb_first(const rb_root_t *root) {
+    rb_node_t *n = root->node;
+    if (!n)
+        return 0;
+    while (n->left)
+        n = n->left;
+    return n;
+}
+
+rb_node_t *rb_last(const rb_root_t *root) {
+    rb_node_t *n = root->node;
+    if (!n)
+        return 0;
+    while (n->right)
+        n = n->right;
+    return n;
+}
+
+rb_node_t *rb_next(const rb_node_t *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left)
+            node = node->left;
+        return (rb_node_t *)node;
+    }
+
+    rb_node_t *p = node->parent;
+    while (p && node == p->right) {
+        node = p;
+        p = p->parent;
+    }
+    return p;
+}
+
+void rb_insert_cached(rb_root_cached_t *root, rb_node_t *node, rb_less_t less) {
+    if (link_node(&root->root, node, less))
+        root->leftmost = node;
+    insert_fixup(&root->root, node);
+}
+
+void rb_erase_cached(rb_root_cached_t *root, rb_node_t *node) {
+    if (root->leftmost == node)
+        root->leftmost = rb_next(node);
+    rb_erase(&root->root, node);
+}
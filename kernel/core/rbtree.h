@@ -0,0 +1,47 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Intrusive red-black tree. Nodes are embedded in the owning struct and
+ * recovered with rb_entry(); the tree never allocates.
+ */
+
+typedef struct rb_node {
+        struct rb_node *parent;
+        struct rb_node *left;
+        struct rb_node *right;
+        uint8_t color;
+} rb_node_t;
+
+typedef struct rb_root {
+        rb_node_t *node;
+} rb_root_t;
+
+/* root + cached leftmost node, for O(1) "smallest key" lookups */
+typedef struct rb_root_cached {
+        rb_root_t root;
+        rb_node_t *leftmost;
+} rb_root_cached_t;
+
+/* returns nonzero if a sorts before b */
+typedef int (*rb_less_t)(const rb_node_t *a, const rb_node_t *b);
+
+#define rb_entry(ptr, type, member)                                            \
+    ((type *)((uintptr_t)(ptr) - offsetof(type, member)))
+
+void rb_insert(rb_root_t *root, rb_node_t *node, rb_less_t less);
+void rb_erase(rb_root_t *root, rb_node_t *node);
+
+rb_node_t *rb_first(const rb_root_t *root);
+rb_node_t *rb_last(const rb_root_t *root);
+rb_node_t *rb_next(const rb_node_t *node);
+
+void rb_insert_cached(rb_root_cached_t *root, rb_node_t *node, rb_less_t less);
+void rb_erase_cached(rb_root_cached_t *root, rb_node_t *node);
+
+static inline rb_node_t *rb_first_cached(const rb_root_cached_t *root) {
+    return root->leftmost;
+}
+
+static inline int rb_empty(const rb_root_t *root) { return root->node == 0; }
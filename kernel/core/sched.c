@@ -2,50 +2,167 @@
 #include "../arch/x86_64/cpu/cpu_local.h"
 #include "../arch/x86_64/cpu/gdt.h"
 #include "../arch/x86_64/cpu/idt.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "../arch/x86_64/cpu/lapic.h"
+#include "../arch/x86_64/cpu/relax.h"
 #include "../arch/x86_64/cpu/timer.h"
+#include "../arch/x86_64/cpu/topology.h"
+#include "../arch/x86_64/cpu/tsc.h"
+#include "mutex.h"
+#include "panic.h"
+#include "print.h"
+#include "preempt.h"
 #include "regs.h"
+#include "spinlock.h"
+#include "sched_internal.h"
 #include <stddef.h>
 #include <stdint.h>
 
-static thread_t *g_current;
-static uint32_t g_quantum_ns;
-static uint64_t g_slice_end_ns;
+/* switch.S / isr.S */
+extern void switch_to(uint64_t *prev_ksp, uint64_t next_ksp,
+                      uint8_t *prev_on_cpu);
+extern void kthread_entry(void);
+extern void irq_return(void);
 
-// static void sched_wake_cb(void *arg) {
-//     thread_t *t = (thread_t *)arg;
-//     t->state = THREAD_READY;
-// }
+/* callee-saved registers pushed by switch_to, in pop order */
+typedef struct switch_frame {
+        uint64_t r15, r14, r13, r12, rbx, rbp;
+        uint64_t rip;
+} switch_frame_t;
 
-static thread_t *pick_next(void) {
-    thread_t *t = g_current->next;
-    while (t != g_current && t->state != THREAD_READY)
-        t = t->next;
-    return (t->state == THREAD_READY) ? t : g_current;
-}
+/*
+ * Idle wait selection by time to the next timer deadline:
+ *   gap <= TPAUSE_MAX  -> TPAUSE until the deadline, timer left disarmed
+ *   gap <= MWAIT_MAX   -> MWAIT on rq.seq, timer armed
+ *   otherwise / none   -> HLT (timer armed only if there is a deadline)
+ */
+#define IDLE_TPAUSE_MAX_NS 1000ull
+#define IDLE_MWAIT_MAX_NS 100000ull
 
-static uint64_t sched_next_deadline(uint64_t now) {
-    uint64_t deadline = timerq_next_deadline();
+/*
+ * Load balancing. Every BALANCE_INTERVAL_NS each cpu compares its fair
+ * load with the busiest other queue and pulls threads over once that
+ * queue carries more than BALANCE_IMBALANCE_PCT of its own load, which
+ * keeps small differences from bouncing threads back and forth. A thread
+ * that ran less than the migration cost ago is cache hot and stays put;
+ * the cost depends on how much cache the two cpus share. After
+ * BALANCE_HOT_RETRIES fruitless passes hot threads are fair game too.
+ * Deadline threads are accounted per cpu and never move.
+ */
+#define BALANCE_INTERVAL_NS 4000000ull
+#define BALANCE_IMBALANCE_PCT 125ull
+#define BALANCE_HOT_RETRIES 4u
 
-    if (g_quantum_ns && pick_next() != g_current) {
-        if (!g_slice_end_ns || g_slice_end_ns <= now) {
-            g_slice_end_ns = now + g_quantum_ns;
-        }
-        if (!deadline || g_slice_end_ns < deadline)
-            deadline = g_slice_end_ns;
+static const uint64_t g_migration_cost_ns[] = {
+    [TOPO_SAME_CPU] = 0,
+    [TOPO_SMT] = 0,
+    [TOPO_PACKAGE] = 500000,
+    [TOPO_REMOTE] = 5000000,
+};
+
+static runqueue_t g_rqs[MAX_CPUS];
+
+/* registry for stats dumps; threads are never freed */
+static spinlock_t g_threads_lock = SPINLOCK_INIT;
+static thread_t *g_threads;
+static uint32_t g_next_tid;
+
+static inline runqueue_t *cpu_rq(uint32_t cpu) { return &g_rqs[cpu]; }
+
+/* interrupts or preemption must be off */
+static inline runqueue_t *this_rq(void) { return cpu_rq(this_cpu_id()); }
+
+runqueue_t *task_rq(thread_t *t) { return cpu_rq(t->cpu); }
+
+/* t->cpu only changes under the old queue's lock */
+static runqueue_t *task_rq_lock(thread_t *t) {
+    for (;;) {
+        runqueue_t *rq = task_rq(t);
+        spin_lock(&rq->lock);
+        if (rq == task_rq(t))
+            return rq;
+        spin_unlock(&rq->lock);
+    }
+}
+
+/* lower address first so two cpus never wait on each other */
+static void double_rq_lock(runqueue_t *a, runqueue_t *b) {
+    if (a == b) {
+        spin_lock(&a->lock);
+    } else if (a < b) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
     } else {
-        g_slice_end_ns = 0;
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
     }
-    return deadline;
 }
 
-static void sched_arm_timer(void) {
-    if (!g_quantum_ns && !timerq_next_deadline()) {
-        timer_stop();
+static void double_rq_unlock(runqueue_t *a, runqueue_t *b) {
+    spin_unlock(&a->lock);
+    if (a != b)
+        spin_unlock(&b->lock);
+}
+
+static void sched_wake_cb(void *arg) { sched_wakeup((thread_t *)arg); }
+
+/* make another cpu look at its queue; the irq return does the rest */
+void sched_kick(uint32_t cpu) {
+    lapic_send_ipi(g_cpus[cpu]->apic_id, LAPIC_RESCHED_VECTOR);
+}
+
+/*
+ * Ask rq's curr to give up the cpu at the next preemption point: the
+ * outermost preempt_enable(), the next return from interrupt, or a
+ * voluntary schedule(). The time it was first requested feeds the
+ * latency stat.
+ */
+void rq_resched(runqueue_t *rq) {
+    cpu_local_t *cl = g_cpus[rq->cpu];
+    if (cl->need_resched)
         return;
+    rq->resched_since_ns = timer_now_ns();
+    cl->need_resched = 1;
+    if (rq->cpu != this_cpu_id())
+        sched_kick(rq->cpu);
+}
+
+static void sched_update_curr(runqueue_t *rq, uint64_t now) {
+    dl_update_curr(rq, now);
+    fair_update_curr(rq, now);
+}
+
+static inline int rq_has_queued(const runqueue_t *rq) {
+    return rq->dl.nr_queued || rq->fair.nr_queued;
+}
+
+/*
+ * One-shot deadline for this cpu: the earliest timerq event, the end of
+ * curr's slice if anyone is waiting for the cpu, the point a deadline
+ * thread runs out of budget, the next balance pass, or "now" if a
+ * reschedule is pending and nothing else would act on it. With preemption
+ * disabled preempt_enable() does the switch, so there is no point
+ * interrupting the critical section.
+ */
+static void sched_arm_timer(runqueue_t *rq) {
+    uint64_t now = timer_now_ns_fast();
+    uint64_t deadline = timerq_next_deadline();
+
+    if (need_resched()) {
+        if (!preempt_count() && rq->curr != rq->idle)
+            deadline = now;
+    } else {
+        uint64_t slice_end = fair_slice_end(rq, now);
+        if (slice_end && (!deadline || slice_end < deadline))
+            deadline = slice_end;
+
+        uint64_t budget_end = dl_budget_end(rq, now);
+        if (budget_end && (!deadline || budget_end < deadline))
+            deadline = budget_end;
     }
 
-    uint64_t now = timer_now_ns();
-    uint64_t deadline = sched_next_deadline(now);
+    if (g_nr_cpus > 1 && (!deadline || rq->next_balance_ns < deadline))
+        deadline = rq->next_balance_ns;
 
     if (!deadline) {
         timer_stop();
@@ -55,84 +172,991 @@ static void sched_arm_timer(void) {
     uint64_t delta = (deadline > now) ? (deadline - now) : 1;
     timer_oneshot_ns(delta);
 }
+
+/* the timer is per cpu; a remote queue re-arms its own on the kick */
+static void rq_update_timer(runqueue_t *rq) {
+    if (rq == this_rq())
+        sched_arm_timer(rq);
+    else
+        sched_kick(rq->cpu);
+}
+
 static void zero_thread(thread_t *t) {
     uint8_t *p = (uint8_t *)t;
     for (size_t i = 0; i < sizeof(*t); i++)
         p[i] = 0;
 }
 
+static void thread_register(thread_t *t) {
+    uint64_t flags = spin_lock_irqsave(&g_threads_lock);
+    t->tid = g_next_tid++;
+    t->all_next = g_threads;
+    g_threads = t;
+    spin_unlock_irqrestore(&g_threads_lock, flags);
+}
+
+/*
+ * Build the initial kernel stack of a user thread:
+ *
+ *   kstack_top -> isr_frame_t   (consumed by irq_return + iretq)
+ *                 switch_frame  (rip = irq_return)
+ *   ksp        ->
+ */
 void thread_init_user(thread_t *t, uint64_t entry, uint64_t user_stack_top,
                       uint64_t kstack_top) {
     zero_thread(t);
-    t->frame.rip = entry;
-    t->frame.cs = USER_CS;
-    t->frame.rflags = 0x202;
-    t->frame.rsp = user_stack_top;
-    t->frame.ss = USER_DS;
+
+    isr_frame_t *frame = (isr_frame_t *)(kstack_top - sizeof(isr_frame_t));
+    uint8_t *p = (uint8_t *)frame;
+    for (size_t i = 0; i < sizeof(*frame); i++)
+        p[i] = 0;
+    frame->rip = entry;
+    frame->cs = USER_CS;
+    frame->rflags = 0x202;
+    frame->rsp = user_stack_top;
+    frame->ss = USER_DS;
+
+    switch_frame_t *sw = (switch_frame_t *)frame - 1;
+    *sw = (switch_frame_t){.rip = (uint64_t)irq_return};
+
+    t->ksp = (uint64_t)sw;
     t->kstack_top = kstack_top;
     t->state = THREAD_READY;
+    t->cpu = this_cpu_id();
+    t->affinity = CPUMASK_ALL;
+    t->fair.weight = NICE_0_WEIGHT;
+    thread_register(t);
 }
 
-void sched_init(thread_t *bootstrap) {
-    g_current = bootstrap;
-    bootstrap->state = THREAD_RUNNING;
-    bootstrap->next = bootstrap;
+/*
+ * Kernel threads start in kthread_entry with fn/arg in r12/r13. The switch
+ * frame sits 8 bytes below a zeroed fake return address so that rsp is
+ * 16-byte aligned once switch_to has returned into kthread_entry.
+ */
+void thread_init_kernel(thread_t *t, thread_fn_t fn, void *arg,
+                        uint64_t kstack_top) {
+    zero_thread(t);
+
+    uint64_t *top = (uint64_t *)(kstack_top & ~0xfull);
+    top[-1] = 0;
+    top[-2] = 0;
+
+    switch_frame_t *sw = (switch_frame_t *)(top - 2) - 1;
+    *sw = (switch_frame_t){
+        .r12 = (uint64_t)fn,
+        .r13 = (uint64_t)arg,
+        .rip = (uint64_t)kthread_entry,
+    };
+
+    t->ksp = (uint64_t)sw;
+    t->kstack_top = kstack_top;
+    t->state = THREAD_READY;
+    t->cpu = this_cpu_id();
+    t->affinity = CPUMASK_ALL;
+    t->fair.weight = NICE_0_WEIGHT;
+    thread_register(t);
 }
 
+/*
+ * The calling context becomes this CPU's idle thread. It never sits on a
+ * queue and is only picked when nothing else is runnable.
+ */
+void sched_init(thread_t *idle) {
+    uint32_t cpu = this_cpu_id();
+    runqueue_t *rq = cpu_rq(cpu);
+
+    rq->cpu = cpu;
+    rq->idle = idle;
+    rq->curr = idle;
+    idle->state = THREAD_RUNNING;
+    idle->cpu = cpu;
+    idle->affinity = 1ull << cpu;
+    idle->on_cpu = 1;
+    idle->stats.stamp_tsc = rdtsc();
+    idle->stats.last_cpu = cpu;
+    // the first slice is timed from here, not from tsc 0
+    rq->curr_since_tsc = idle->stats.stamp_tsc;
+    thread_register(idle);
+}
+
+/* latency target shared out among runnable fair threads; 0 disables */
 void sched_set_quantum_ns(uint64_t ns) {
-    g_quantum_ns = ns;
-    if (!ns)
-        timer_stop();
-    else
-        sched_arm_timer();
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    fair_set_latency(ns);
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+    preempt_enable();
 }
 
-void sched_add(thread_t *t) {
-    if (!g_current) {
-        sched_init(t);
+static void sched_enqueue(runqueue_t *rq, thread_t *t, int wakeup) {
+    t->state = THREAD_READY;
+    t->cpu = rq->cpu;
+
+    if (dl_task(t)) {
+        dl_activate(rq, t, timer_now_ns());
+        if (t->dl.throttled)
+            return; // the replenish timer queues it
+        dl_enqueue(rq, t);
+        rq->seq++;
+        if (dl_wakeup_preempt(rq, t))
+            rq_resched(rq);
         return;
     }
 
-    t->next = g_current->next;
-    g_current->next = t;
+    fair_place(rq, t, wakeup);
+    fair_enqueue(rq, t);
+    rq->seq++;
 
-    g_slice_end_ns = 0;
-    sched_arm_timer();
+    if (fair_wakeup_preempt(rq, t))
+        rq_resched(rq);
 }
 
-void sched_start(void) { sched_arm_timer(); }
+static inline int cpu_allowed(const thread_t *t, uint32_t cpu) {
+    return cpu < g_nr_cpus && (t->affinity & (1ull << cpu));
+}
 
-void sched_on_tick(isr_frame_t *frame) {
-    if (!g_current)
-        return;
+static inline int rq_idle(const runqueue_t *rq) {
+    return rq->curr == rq->idle && !rq_has_queued(rq);
+}
+
+/*
+ * Placement for a thread becoming runnable: its previous cpu if that is
+ * idle, else the idle cpu sharing the most cache with it, else the
+ * previous cpu, else the first one it may run on. Reads other queues
+ * without their locks; a stale answer only costs a later balance pass.
+ */
+static uint32_t select_cpu(thread_t *t) {
+    uint32_t prev = t->cpu;
+
+    if (dl_task(t))
+        return prev; // admitted against this cpu's bandwidth
+
+    if (cpu_allowed(t, prev) && rq_idle(cpu_rq(prev)))
+        return prev;
+
+    uint32_t best = MAX_CPUS, first = MAX_CPUS;
+    topo_distance_t best_dist = TOPO_REMOTE;
+
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        if (!cpu_allowed(t, cpu))
+            continue;
+        if (first == MAX_CPUS)
+            first = cpu;
+        if (!rq_idle(cpu_rq(cpu)))
+            continue;
 
+        topo_distance_t d = topology_distance(prev, cpu);
+        if (best == MAX_CPUS || d < best_dist) {
+            best = cpu;
+            best_dist = d;
+        }
+    }
+
+    if (best != MAX_CPUS)
+        return best;
+    if (cpu_allowed(t, prev))
+        return prev;
+    return (first != MAX_CPUS) ? first : this_cpu_id();
+}
+
+/*
+ * Queue a thread that is on no queue (new, WAKING) on the cpu chosen for
+ * it. src is the queue it last belonged to, for vruntime normalisation.
+ * Interrupts disabled, no queue locks held.
+ */
+static void sched_place(runqueue_t *src, thread_t *t, int wakeup) {
+    runqueue_t *dst = cpu_rq(select_cpu(t));
     uint64_t now = timer_now_ns();
-    timerq_run_expired(now);
 
-    if ((frame->cs & 3) != 3) {
-        sched_arm_timer();
+    spin_lock(&dst->lock);
+    if (dst != src && !dl_task(t))
+        fair_migrate(src, dst, t);
+    sched_update_curr(dst, now);
+    sched_enqueue(dst, t, wakeup);
+    rq_update_timer(dst);
+    spin_unlock(&dst->lock);
+}
+
+void sched_add(thread_t *t) {
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+    t->state = THREAD_WAKING;
+    t->stats.stamp_tsc = rdtsc();
+    sched_place(task_rq(t), t, 0);
+    cpu_irq_restore(flags);
+    preempt_enable();
+}
+
+void sched_start(void) {
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->next_balance_ns = timer_now_ns() + BALANCE_INTERVAL_NS;
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+/*
+ * Make a blocked thread runnable again. Safe from irq context (timer
+ * callbacks). BLOCKED -> WAKING claims the thread, after which it is on
+ * no queue and can be placed without holding its old queue's lock. If it
+ * should preempt curr, the switch happens on the way out: here for thread
+ * context, at irq return otherwise, via IPI on another cpu.
+ *
+ * A thread that marked itself BLOCKED (wait queues, mutexes) but has not
+ * reached schedule() yet is still curr; flipping it back to RUNNING is
+ * all it takes, schedule() then keeps it runnable.
+ */
+void sched_wakeup(thread_t *t) {
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+
+    runqueue_t *rq = task_rq_lock(t);
+    int claimed = 0;
+    if (t->state == THREAD_BLOCKED) {
+        if (t == rq->curr) {
+            t->state = THREAD_RUNNING;
+        } else {
+            t->state = THREAD_WAKING;
+            claimed = 1;
+        }
+    }
+    spin_unlock(&rq->lock);
+
+    if (claimed) {
+        t->stats.stamp_tsc = rdtsc(); // runnable from here on
+        t->stats.woken = 1;
+        sched_place(rq, t, 1);
+    }
+
+    cpu_irq_restore(flags);
+    preempt_enable();
+}
+
+int sched_set_nice(thread_t *t, int nice) {
+    if (nice < NICE_MIN || nice > NICE_MAX)
+        return -1;
+
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = task_rq_lock(t);
+    if (t == rq->curr)
+        fair_update_curr(rq, timer_now_ns());
+    t->fair.nice = (int8_t)nice;
+    uint32_t weight = fair_nice_to_weight(nice);
+    if (t->pi_donor && t->pi_donor->fair.weight > weight)
+        weight = t->pi_donor->fair.weight; // keep the inherited boost
+    fair_reweight(rq, t, weight);
+    rq_update_timer(rq);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+    preempt_enable();
+    return 0;
+}
+
+/*
+ * Move t into the deadline class with the given reservation, or back to
+ * the fair class if runtime_ns is 0. Fails if the parameters are not
+ * runtime <= deadline <= period or the reservation does not fit on t's
+ * cpu.
+ */
+int sched_set_deadline(thread_t *t, uint64_t runtime_ns, uint64_t deadline_ns,
+                       uint64_t period_ns) {
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = task_rq_lock(t);
+    uint64_t now = timer_now_ns();
+    int queued = (t->state == THREAD_READY && t != rq->curr);
+
+    if (t == rq->curr)
+        sched_update_curr(rq, now);
+
+    if (runtime_ns && dl_admit(rq, t, runtime_ns, deadline_ns, period_ns)) {
+        spin_unlock(&rq->lock);
+        cpu_irq_restore(flags);
+        preempt_enable();
+        return -1;
+    }
+
+    // take t off whichever queue it is on, requeue under the new policy
+    if (queued) {
+        if (dl_task(t)) {
+            if (!t->dl.throttled)
+                dl_dequeue(rq, t);
+        } else {
+            fair_dequeue(rq, t);
+        }
+    }
+
+    if (runtime_ns) {
+        if (t->policy == SCHED_DEADLINE && t->dl.throttled) {
+            // let the pending replenish start the job with new params
+        } else {
+            t->dl.abs_deadline_ns = now + deadline_ns;
+            t->dl.remaining_ns = runtime_ns;
+            t->dl.missed = 0;
+        }
+        t->dl.exec_start_ns = now;
+        t->policy = SCHED_DEADLINE;
+    } else {
+        dl_release(rq, t);
+        t->policy = SCHED_FAIR;
+        t->fair.exec_start_ns = now;
+    }
+
+    if (queued)
+        sched_enqueue(rq, t, 0);
+    else if (t == rq->curr)
+        rq_resched(rq);
+
+    rq_update_timer(rq);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+    preempt_enable();
+    return 0;
+}
+
+/*
+ * Restrict t to the cpus in mask (offline ones are ignored). A queued
+ * thread that may no longer stay is moved right away; a running one moves
+ * when it is next switched out. Deadline threads must keep their cpu.
+ */
+int sched_set_affinity(thread_t *t, cpumask_t mask) {
+    cpumask_t online =
+        (g_nr_cpus >= 64) ? CPUMASK_ALL : ((1ull << g_nr_cpus) - 1);
+    mask &= online;
+    if (!mask)
+        return -1;
+
+    preempt_disable();
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = task_rq_lock(t);
+    int stays = (mask & (1ull << t->cpu)) != 0;
+    int moved = 0;
+
+    if (!stays && dl_task(t)) {
+        spin_unlock(&rq->lock);
+        cpu_irq_restore(flags);
+        preempt_enable();
+        return -1;
+    }
+
+    t->affinity = mask;
+
+    // a sleeper's wakeup should come from where it may run
+    if (!stays && t->state == THREAD_BLOCKED)
+        timerq_migrate(&t->sleep_event, (uint32_t)__builtin_ctzll(mask));
+
+    if (!stays) {
+        if (t == rq->curr) {
+            rq_resched(rq);
+        } else if (t->state == THREAD_READY) {
+            fair_dequeue(rq, t);
+            t->state = THREAD_WAKING;
+            moved = 1;
+        }
+    }
+    spin_unlock(&rq->lock);
+
+    if (moved)
+        sched_place(rq, t, 0);
+
+    cpu_irq_restore(flags);
+    preempt_enable();
+    return 0;
+}
+
+/*
+ * Effective priority order used by priority inheritance: the deadline
+ * class (reservations and boosted threads) beats the fair class, earlier
+ * deadline first within it; fair threads compare by weight.
+ */
+int sched_prio_higher(const thread_t *a, const thread_t *b) {
+    int a_dl = dl_task(a), b_dl = dl_task(b);
+    if (a_dl != b_dl)
+        return a_dl;
+    if (a_dl)
+        return (int64_t)(a->dl.abs_deadline_ns - b->dl.abs_deadline_ns) < 0;
+    return a->fair.weight > b->fair.weight;
+}
+
+/*
+ * Run t with donor's priority while it holds a lock donor waits for, or
+ * drop back to t's own parameters if donor is NULL. A deadline donor
+ * pulls t into the deadline class on the donor's deadline (without a
+ * budget of its own); a fair donor lends its weight. Called with the
+ * mutex slow-path lock held.
+ */
+void sched_pi_boost(thread_t *t, thread_t *donor) {
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = task_rq_lock(t);
+    uint64_t now = timer_now_ns();
+    int queued = (t->state == THREAD_READY && t != rq->curr &&
+                  !(t->policy == SCHED_DEADLINE && t->dl.throttled));
+    int was_dl = dl_task(t);
+
+    if (t == rq->curr)
+        sched_update_curr(rq, now);
+    if (queued) {
+        if (was_dl)
+            dl_dequeue(rq, t);
+        else
+            fair_dequeue(rq, t);
+    }
+
+    t->pi_donor = donor;
+    if (donor && dl_task(donor)) {
+        if (t->policy != SCHED_DEADLINE)
+            t->dl.abs_deadline_ns = donor->dl.abs_deadline_ns;
+        t->dl.boosted = 1;
+        if (t->dl.throttled) {
+            // finish the critical section now, the budget comes later
+            timerq_cancel(&t->dl.replenish);
+            t->dl.throttled = 0;
+            queued = (t->state == THREAD_READY && t != rq->curr);
+        }
+    } else {
+        uint32_t weight = fair_nice_to_weight(t->fair.nice);
+        if (donor && donor->fair.weight > weight)
+            weight = donor->fair.weight;
+        t->dl.boosted = 0;
+        t->fair.weight = weight;
+    }
+
+    if (dl_task(t) != was_dl) {
+        t->dl.exec_start_ns = now;
+        t->fair.exec_start_ns = now;
+        if (!dl_task(t))
+            fair_place(rq, t, 0);
+    }
+
+    if (queued) {
+        if (dl_task(t))
+            dl_enqueue(rq, t);
+        else
+            fair_enqueue(rq, t);
+        if (rq->curr == rq->idle || sched_prio_higher(t, rq->curr))
+            rq_resched(rq);
+    } else if (t == rq->curr) {
+        rq_resched(rq); // may have lost its boost to someone queued
+    }
+
+    rq_update_timer(rq);
+    spin_unlock(&rq->lock);
+    cpu_irq_restore(flags);
+}
+
+/* resched IPI: the preemption point on irq return does the switch */
+void sched_on_ipi(isr_frame_t *frame) {
+    (void)frame;
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+}
+
+static void __schedule(runqueue_t *rq);
+
+void thread_sleep_until(uint64_t deadline_ns) {
+    uint64_t flags = cpu_irq_save();
+
+    if (deadline_ns > timer_now_ns()) {
+        runqueue_t *rq = this_rq();
+        spin_lock(&rq->lock);
+
+        thread_t *t = rq->curr;
+        t->state = THREAD_BLOCKED;
+        t->block_reason = BLOCK_SLEEP;
+
+        t->sleep_event.deadline_ns = deadline_ns;
+        t->sleep_event.slack_ns =
+            dl_task(t) ? TIMER_SLACK_RT_NS : TIMER_SLACK_SLEEP_NS;
+        t->sleep_event.cb = sched_wake_cb;
+        t->sleep_event.arg = t;
+        timerq_insert(&t->sleep_event);
+
+        __schedule(rq);
+    }
+
+    cpu_irq_restore(flags);
+}
+
+void thread_sleep_ns(uint64_t ns) {
+    uint64_t deadline;
+    if (__builtin_add_overflow(timer_now_ns(), ns, &deadline))
+        deadline = UINT64_MAX; // practically forever, not already past
+    thread_sleep_until(deadline);
+}
+
+thread_t *sched_current(void) {
+    uint64_t flags = cpu_irq_save();
+    thread_t *t = this_rq()->curr;
+    cpu_irq_restore(flags);
+    return t;
+}
+
+/*
+ * Snapshot without locks: counters are only written by the cpu running
+ * or switching the thread, so a racing read is at worst one switch stale.
+ */
+void sched_thread_stats(const thread_t *t, thread_stats_info_t *out) {
+    uint64_t run = t->stats.run_tsc;
+    // include the interval in progress
+    if (t->state == THREAD_RUNNING) {
+        uint64_t tsc = rdtsc();
+        if (tsc > t->stats.stamp_tsc)
+            run += tsc - t->stats.stamp_tsc;
+    }
+    out->run_ns = timer_tsc_to_ns(run);
+    out->wait_ns = timer_tsc_to_ns(t->stats.wait_tsc);
+    out->nr_voluntary = t->stats.nr_voluntary;
+    out->nr_involuntary = t->stats.nr_involuntary;
+    out->last_cpu = t->stats.last_cpu;
+    out->tid = t->tid;
+}
+
+static const char *const g_state_names[] = {
+    [THREAD_READY] = "ready",     [THREAD_RUNNING] = "run",
+    [THREAD_BLOCKED] = "blocked", [THREAD_WAKING] = "waking",
+    [THREAD_ZOMBIE] = "zombie",
+};
+
+#define STATS_DUMP_BATCH 16
+
+/* scratch for sched_dump_stats(), filled under g_threads_lock */
+static struct {
+        thread_stats_info_t st;
+        thread_state_t state;
+} g_stats_snap[STATS_DUMP_BATCH];
+static mutex_t g_stats_dump_lock = MUTEX_INIT;
+
+/*
+ * Snapshot a batch under the lock, print it with interrupts back on.
+ * Threads are never freed and only ever pushed at the head, so the cursor
+ * stays valid across batches; ones registered meanwhile are not listed.
+ */
+void sched_dump_stats(void) {
+    mutex_lock(&g_stats_dump_lock);
+    kprintln("[sched] tid state cpu run_us wait_us vol invol");
+
+    uint64_t flags = spin_lock_irqsave(&g_threads_lock);
+    thread_t *cursor = g_threads;
+    spin_unlock_irqrestore(&g_threads_lock, flags);
+
+    while (cursor) {
+        uint32_t n = 0;
+        flags = spin_lock_irqsave(&g_threads_lock);
+        for (; cursor && n < STATS_DUMP_BATCH; cursor = cursor->all_next) {
+            sched_thread_stats(cursor, &g_stats_snap[n].st);
+            g_stats_snap[n].state = cursor->state;
+            n++;
+        }
+        spin_unlock_irqrestore(&g_threads_lock, flags);
+
+        for (uint32_t i = 0; i < n; i++) {
+            const thread_stats_info_t *st = &g_stats_snap[i].st;
+            kprintlnf("[sched] %u %s %u %llu %llu %llu %llu", st->tid,
+                      g_state_names[g_stats_snap[i].state], st->last_cpu,
+                      (unsigned long long)(st->run_ns / 1000),
+                      (unsigned long long)(st->wait_ns / 1000),
+                      (unsigned long long)st->nr_voluntary,
+                      (unsigned long long)st->nr_involuntary);
+        }
+    }
+    mutex_unlock(&g_stats_dump_lock);
+}
+
+/* scratch for dumping, so no queue lock is held while printing */
+static hist_t g_hist_snap;
+static mutex_t g_hist_dump_lock = MUTEX_INIT;
+
+static void hist_dump_one(runqueue_t *rq, const hist_t *h, const char *name,
+                          uint64_t (*conv)(uint64_t)) {
+    uint64_t flags = spin_lock_irqsave(&rq->lock);
+    g_hist_snap = *h;
+    spin_unlock_irqrestore(&rq->lock, flags);
+    hist_dump(name, &g_hist_snap, conv);
+}
+
+void sched_dump_hist(void) {
+    mutex_lock(&g_hist_dump_lock);
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        runqueue_t *rq = cpu_rq(cpu);
+        kprintlnf("[sched] cpu %u", cpu);
+        hist_dump_one(rq, &rq->hist.wakeup_lat, "wakeup_ns", timer_tsc_to_ns);
+        hist_dump_one(rq, &rq->hist.slice, "slice_ns", timer_tsc_to_ns);
+        hist_dump_one(rq, &rq->hist.depth, "depth", NULL);
+    }
+    mutex_unlock(&g_hist_dump_lock);
+}
+
+void sched_reset_hist(void) {
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        runqueue_t *rq = cpu_rq(cpu);
+        uint64_t flags = spin_lock_irqsave(&rq->lock);
+        hist_reset(&rq->hist.wakeup_lat);
+        hist_reset(&rq->hist.slice);
+        hist_reset(&rq->hist.depth);
+        spin_unlock_irqrestore(&rq->lock, flags);
+    }
+}
+
+/* worst over all cpus */
+uint64_t sched_max_latency_ns(void) {
+    uint64_t max = 0;
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        if (cpu_rq(cpu)->max_latency_ns > max)
+            max = cpu_rq(cpu)->max_latency_ns;
+    }
+    return max;
+}
+
+/*
+ * Pull fair threads from busiest until roughly imbalance weight has moved.
+ * Both locks held. Walks the timeline from the left, skipping threads
+ * pinned elsewhere, still switching out, or cache hot (unless forced).
+ */
+static uint64_t balance_pull(runqueue_t *this, runqueue_t *busiest,
+                             uint64_t imbalance, uint64_t now, int force) {
+    uint64_t hot_ns =
+        g_migration_cost_ns[topology_distance(busiest->cpu, this->cpu)];
+    uint64_t moved = 0;
+
+    rb_node_t *n = rb_first_cached(&busiest->fair.timeline);
+    while (n && moved < imbalance) {
+        thread_t *t = rb_entry(n, thread_t, fair.node);
+        n = rb_next(n);
+
+        if (!cpu_allowed(t, this->cpu) || t->on_cpu ||
+            t == busiest->fair.skip)
+            continue;
+        if (!force && now - t->last_ran_ns < hot_ns)
+            continue;
+
+        fair_dequeue(busiest, t);
+        fair_migrate(busiest, this, t);
+        t->cpu = this->cpu;
+        fair_enqueue(this, t);
+        moved += t->fair.weight;
+    }
+
+    if (moved)
+        this->seq++;
+    return moved;
+}
+
+/*
+ * Periodic balance, run by each cpu for itself with no locks held. Only
+ * ever pulls, so two cpus never fight over the same thread.
+ */
+static void load_balance(runqueue_t *this, uint64_t now) {
+    this->next_balance_ns = now + BALANCE_INTERVAL_NS;
+    if (g_nr_cpus < 2)
         return;
+
+    runqueue_t *busiest = 0;
+    uint64_t busiest_load = 0;
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        runqueue_t *rq = cpu_rq(cpu);
+        if (rq == this || !rq->fair.nr_queued)
+            continue;
+        uint64_t load = fair_rq_load(rq);
+        if (load > busiest_load) {
+            busiest = rq;
+            busiest_load = load;
+        }
     }
 
-    if (!g_slice_end_ns || now < g_slice_end_ns) {
-        sched_arm_timer();
+    uint64_t this_load = fair_rq_load(this);
+    if (!busiest ||
+        busiest_load * 100 <= this_load * BALANCE_IMBALANCE_PCT) {
+        this->balance_failed = 0;
         return;
     }
 
-    g_current->frame = *frame;
+    double_rq_lock(this, busiest);
+    uint64_t imbalance = (fair_rq_load(busiest) - fair_rq_load(this)) / 2;
+    uint64_t moved = 0;
+    if ((int64_t)imbalance > 0) {
+        int force = this->balance_failed >= BALANCE_HOT_RETRIES;
+        moved = balance_pull(this, busiest, imbalance, now, force);
+    }
+    double_rq_unlock(this, busiest);
 
-    thread_t *next = pick_next();
-    if (next != g_current) {
-        g_current->state = THREAD_READY;
-        next->state = THREAD_RUNNING;
-        g_current = next;
+    if (moved) {
+        this->balance_failed = 0;
+        if (this->curr == this->idle)
+            rq_resched(this);
+    } else {
+        this->balance_failed++;
+    }
+}
 
-        g_cpu_local.kernel_rsp = next->kstack_top;
+/*
+ * Interrupts must be disabled. Returns once prev is picked again.
+ */
+static void sched_switch(thread_t *prev, thread_t *next) {
+    // next may have been queued here while still switching out elsewhere
+    while (__atomic_load_n(&next->on_cpu, __ATOMIC_ACQUIRE))
+        __asm__ volatile("pause" ::: "memory");
+    next->on_cpu = 1;
+
+    if (next->kstack_top) {
+        this_cpu()->kernel_rsp = next->kstack_top;
         gdt_set_kernel_stack(next->kstack_top);
+    }
+
+    fpu_switch(&prev->fpu, &next->fpu);
+    switch_to(&prev->ksp, next->ksp, &prev->on_cpu);
+}
+
+/*
+ * Interrupts disabled, rq->lock held; drops the lock before switching.
+ * prev is requeued here unless it blocked, or moved to another cpu if its
+ * affinity no longer allows this one.
+ */
+static void __schedule(runqueue_t *rq) {
+    if (preempt_count())
+        panic("sched: schedule() with preemption disabled");
+
+    uint64_t now = timer_now_ns_fast();
+    uint64_t tsc = rdtsc();
+    thread_t *prev = rq->curr;
+    thread_t *migrate = 0;
+    cpu_local_t *cl = this_cpu();
+
+    if (cl->need_resched) {
+        uint64_t lat = now - rq->resched_since_ns;
+        if (lat > rq->max_latency_ns)
+            rq->max_latency_ns = lat;
+        cl->need_resched = 0;
+    }
+
+    if (prev != rq->idle) {
+        sched_update_curr(rq, now);
+        prev->last_ran_ns = now;
+        if (prev->state == THREAD_RUNNING) {
+            if (!cpu_allowed(prev, rq->cpu)) {
+                prev->state = THREAD_WAKING;
+                migrate = prev;
+            } else if (dl_task(prev)) {
+                prev->state = THREAD_READY;
+                if (!prev->dl.throttled)
+                    dl_enqueue(rq, prev);
+            } else {
+                prev->state = THREAD_READY;
+                fair_enqueue(rq, prev);
+            }
+        }
+    }
+
+    hist_record(&rq->hist.depth, rq->dl.nr_queued + rq->fair.nr_queued);
+
+    // deadline class first, fair class fills whatever is left
+    thread_t *next = dl_pick_next(rq, now);
+    if (!next)
+        next = fair_pick_next(rq, now);
+    if (!next)
+        next = rq->idle;
+
+    // prev's run ends; if it stays runnable its wait starts now
+    prev->stats.run_tsc += tsc - prev->stats.stamp_tsc;
+    prev->stats.stamp_tsc = tsc;
+    if (next != prev) {
+        if (prev->state == THREAD_BLOCKED || prev->state == THREAD_ZOMBIE)
+            prev->stats.nr_voluntary++;
+        else
+            prev->stats.nr_involuntary++;
+        next->stats.wait_tsc += tsc - next->stats.stamp_tsc;
+        if (next->stats.woken) {
+            hist_record(&rq->hist.wakeup_lat, tsc - next->stats.stamp_tsc);
+            next->stats.woken = 0;
+        }
+        next->stats.stamp_tsc = tsc;
+        next->stats.last_cpu = rq->cpu;
+
+        if (prev != rq->idle)
+            hist_record(&rq->hist.slice, tsc - rq->curr_since_tsc);
+        rq->curr_since_tsc = tsc;
+    }
+
+    next->state = THREAD_RUNNING;
+    next->cpu = rq->cpu;
+    rq->curr = next;
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+
+    if (migrate)
+        sched_place(rq, migrate, 0);
+
+    if (next != prev)
+        sched_switch(prev, next);
+}
+
+void schedule(void) {
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    __schedule(rq);
+    cpu_irq_restore(flags);
+}
+
+/* from preempt_enable()/cond_resched() once the count drops to zero */
+void preempt_schedule(void) {
+    // interrupts off: let the timer fire the moment they are back on
+    // (irq return gets there first if this is irq context)
+    if (!cpu_irq_enabled()) {
+        runqueue_t *rq = this_rq();
+        spin_lock(&rq->lock);
+        sched_arm_timer(rq);
+        spin_unlock(&rq->lock);
+        return;
+    }
+    schedule();
+}
+
+/*
+ * Preemption point on the way out of an interrupt. Interrupts stay off
+ * until iretq; the preempted thread resumes here and returns through the
+ * same frame when it is picked again.
+ */
+void preempt_schedule_irq(void) {
+    if (need_resched() && !preempt_count())
+        schedule();
+}
+
+void sched_yield(void) {
+    uint64_t flags = cpu_irq_save();
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    if (rq->curr->policy == SCHED_DEADLINE)
+        rq->curr->dl.remaining_ns = 0; // done with this job until replenish
+    else
+        rq->fair.skip = rq->curr;
+    __schedule(rq);
+    cpu_irq_restore(flags);
+}
+
+void sched_exit(void) {
+    cpu_irq_save();
+    runqueue_t *rq = this_rq();
+    spin_lock(&rq->lock);
+    rq->curr->state = THREAD_ZOMBIE;
+    dl_release(rq, rq->curr);
+    __schedule(rq);
+    panic("sched: zombie thread resumed");
+}
 
-        *frame = next->frame;
+void sched_on_tick(isr_frame_t *frame) {
+    (void)frame;
+    runqueue_t *rq = this_rq();
+    if (!rq->curr)
+        return;
+
+    // timer callbacks take queue locks themselves
+    uint64_t now = timer_now_ns_fast();
+    timerq_run_expired(now);
+
+    if (now >= rq->next_balance_ns)
+        load_balance(rq, now);
+
+    spin_lock(&rq->lock);
+    // the idle loop re-evaluates on its own once the irq returns
+    if (rq->curr != rq->idle) {
+        sched_update_curr(rq, now);
+        uint64_t slice_end = fair_slice_end(rq, now);
+        if (slice_end && slice_end <= now)
+            rq_resched(rq);
+    }
+
+    // the switch itself happens on irq return, see preempt_schedule_irq()
+    sched_arm_timer(rq);
+    spin_unlock(&rq->lock);
+}
+
+/*
+ * About to sleep deeply: hand this cpu's timers to the nearest busy cpu,
+ * which is awake anyway, rather than wake up just to run them. Whatever a
+ * callback wakes is placed by select_cpu() as usual. Returns 1 if
+ * anything moved.
+ */
+static int idle_push_timers(runqueue_t *rq) {
+    if (g_nr_cpus < 2 || !timerq_nr_pending(rq->cpu))
+        return 0;
+
+    uint32_t best = MAX_CPUS;
+    topo_distance_t best_dist = TOPO_REMOTE;
+
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        const runqueue_t *other = cpu_rq(cpu);
+        if (cpu == rq->cpu || other->curr == other->idle)
+            continue;
+        topo_distance_t d = topology_distance(rq->cpu, cpu);
+        if (best == MAX_CPUS || d < best_dist) {
+            best = cpu;
+            best_dist = d;
+        }
     }
 
-    g_slice_end_ns = 0;
-    sched_arm_timer();
+    if (best == MAX_CPUS)
+        return 0;
+    return timerq_migrate_all(rq->cpu, best) > 0;
+}
+
+void sched_idle(void) {
+    for (;;) {
+        cpu_irq_disable();
+        runqueue_t *rq = this_rq();
+
+        if (rq_has_queued(rq)) {
+            schedule();
+            continue;
+        }
+
+        const uint64_t seq = rq->seq;
+        const uint64_t now = timer_now_ns();
+        const uint64_t deadline = timerq_next_deadline();
+
+        if (deadline && deadline <= now) {
+            timerq_run_expired(now);
+            continue;
+        }
+
+        if (g_nr_cpus > 1 && now >= rq->next_balance_ns) {
+            load_balance(rq, now);
+            continue;
+        }
+
+        const uint64_t gap = deadline ? deadline - now : UINT64_MAX;
+
+        if (gap <= IDLE_TPAUSE_MAX_NS && cpu_has_tpause()) {
+            // cheaper to spin it out than to take a timer interrupt
+            timer_stop();
+            cpu_tpause_until(rdtsc() + timer_ns_to_tsc(gap));
+            timerq_run_expired(timer_now_ns());
+            continue;
+        }
+
+        if (deadline && gap > IDLE_MWAIT_MAX_NS && idle_push_timers(rq))
+            continue;
+
+        spin_lock(&rq->lock);
+        sched_arm_timer(rq);
+        spin_unlock(&rq->lock);
+
+        if (gap <= IDLE_MWAIT_MAX_NS && cpu_has_mwait()) {
+            cpu_monitor(&rq->seq);
+            if (rq->seq == seq)
+                cpu_mwait(0);
+            cpu_irq_window(); // take whatever broke the wait
+            continue;
+        }
+
+        cpu_halt();
+    }
 }
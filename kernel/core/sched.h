@@ -1,5 +1,7 @@
 #pragma once
+#include "../arch/x86_64/cpu/fpu.h"
 #include "../arch/x86_64/cpu/regs.h"
+#include "rbtree.h"
 #include "timerq.h"
 
 #include <stdint.h>
@@ -8,28 +10,141 @@ typedef enum {
     THREAD_READY,
     THREAD_RUNNING,
     THREAD_BLOCKED,
+    THREAD_WAKING, // off every queue, being placed on a cpu
     THREAD_ZOMBIE,
 } thread_state_t;
 
 typedef enum {
     BLOCK_SLEEP,
     BLOCK_MUTEX,
+    BLOCK_WAITQ,
+    BLOCK_FUTEX,
     BLOCK_IPC,
 } thread_block_reason_t;
 
+typedef void (*thread_fn_t)(void *arg);
+
+typedef enum {
+    SCHED_FAIR = 0,
+    SCHED_DEADLINE,
+} sched_policy_t;
+
+#define NICE_MIN (-20)
+#define NICE_MAX 19
+
+/* one bit per cpu id */
+typedef uint64_t cpumask_t;
+#define CPUMASK_ALL (~(cpumask_t)0)
+
+/* fair class bookkeeping, see sched_fair.c */
+typedef struct fair_entity {
+        rb_node_t node;         // timeline link while queued
+        uint64_t vruntime;      // weighted runtime, ns at nice 0
+        uint64_t exec_start_ns; // last runtime update while on cpu
+        uint64_t sum_exec_ns;
+        uint64_t slice_start_ns; // sum_exec_ns when last picked
+        uint32_t weight;
+        int8_t nice;
+} fair_entity_t;
+
+/* deadline class bookkeeping, see sched_dl.c */
+typedef struct dl_entity {
+        rb_node_t node;       // queue link while runnable, keyed by abs
+        uint64_t runtime_ns;  // budget per period
+        uint64_t deadline_ns; // relative to period start
+        uint64_t period_ns;
+        uint64_t bw;          // runtime / period, DL_BW_SHIFT fixed point
+        uint64_t abs_deadline_ns;
+        uint64_t remaining_ns; // budget left for the current job
+        uint64_t exec_start_ns;
+        uint64_t misses; // jobs still unfinished at their deadline
+        timer_event_t replenish;
+        uint8_t throttled; // budget used up, waiting for replenish
+        uint8_t missed;    // current job already counted as a miss
+        uint8_t boosted;   // runs in this class on a PI donor's behalf
+} dl_entity_t;
+
+/*
+ * Raw per-thread accounting in TSC ticks, updated with one rdtsc per
+ * switch and one per wakeup.
+ */
+typedef struct thread_stats {
+        uint64_t run_tsc;        // on a cpu
+        uint64_t wait_tsc;       // runnable, waiting for a cpu
+        uint64_t stamp_tsc;      // start of the current run/wait interval
+        uint64_t nr_voluntary;   // switched out because it blocked
+        uint64_t nr_involuntary; // switched out while still runnable
+        uint32_t last_cpu;
+        uint8_t woken; // stamp_tsc is a wakeup, for the latency histogram
+} thread_stats_t;
+
+/* what SYS_thread_stats hands out, times in ns */
+typedef struct thread_stats_info {
+        uint64_t run_ns;
+        uint64_t wait_ns;
+        uint64_t nr_voluntary;
+        uint64_t nr_involuntary;
+        uint32_t last_cpu;
+        uint32_t tid;
+} thread_stats_info_t;
+
+struct mutex;
+
 typedef struct thread {
-        isr_frame_t frame;
+        uint64_t ksp; // saved kernel rsp while switched out
         uint64_t kstack_top;
+        uint32_t tid;
         thread_state_t state;
-        struct thread *next;
+        thread_block_reason_t block_reason;
+        uint8_t policy;
+        uint8_t on_cpu; // context still live on a cpu; cleared by switch_to
+        uint32_t cpu;   // runqueue it belongs to
+        cpumask_t affinity;
+        uint64_t last_ran_ns; // switched out at, for cache hotness
+        fair_entity_t fair;
+        dl_entity_t dl;
+        /* priority inheritance, protected by the mutex slow-path lock */
+        struct thread *pi_donor;   // top waiter we currently run on behalf of
+        struct mutex *blocked_on;  // mutex this thread sleeps on
+        struct mutex *held;        // mutexes owned, chained via held_next
         timer_event_t sleep_event;
+        fpu_ctx_t fpu;
+        thread_stats_t stats;
+        struct thread *all_next; // every thread ever initialised
 } thread_t;
 
-void sched_init(thread_t *bootstrap);
+void sched_init(thread_t *idle);
 void sched_set_quantum_ns(uint64_t ns);
 void sched_start(void);
 void sched_add(thread_t *t);
 void sched_on_tick(isr_frame_t *frame);
 
+thread_t *sched_current(void);
+uint64_t sched_max_latency_ns(void);
+void preempt_schedule_irq(void);
+void schedule(void);
+void sched_yield(void);
+__attribute__((noreturn)) void sched_exit(void);
+__attribute__((noreturn)) void sched_idle(void);
+
+void sched_wakeup(thread_t *t);
+int sched_set_nice(thread_t *t, int nice);
+int sched_set_deadline(thread_t *t, uint64_t runtime_ns, uint64_t deadline_ns,
+                       uint64_t period_ns);
+int sched_set_affinity(thread_t *t, cpumask_t mask);
+int sched_prio_higher(const thread_t *a, const thread_t *b);
+void sched_pi_boost(thread_t *t, thread_t *donor);
+void sched_on_ipi(isr_frame_t *frame);
+/* make cpu look at its queue and re-arm its one-shot */
+void sched_kick(uint32_t cpu);
+void sched_thread_stats(const thread_t *t, thread_stats_info_t *out);
+void sched_dump_stats(void);
+void sched_dump_hist(void);
+void sched_reset_hist(void);
+void thread_sleep_ns(uint64_t ns);
+void thread_sleep_until(uint64_t deadline_ns);
+
 void thread_init_user(thread_t *t, uint64_t entry, uint64_t user_stack_top,
                       uint64_t kstack_top);
+void thread_init_kernel(thread_t *t, thread_fn_t fn, void *arg,
+                        uint64_t kstack_top);
@@ -0,0 +1,202 @@
+#include "../arch/x86_64/cpu/timer.h"
+#include "sched_internal.h"
+
+/*
+ * Earliest-deadline-first class (SCHED_DEADLINE-style).
+ *
+ * A thread declares runtime <= deadline <= period. Each period it may
+ * consume `runtime` of cpu time and is ordered against other deadline
+ * threads by its absolute deadline. Admission keeps the summed
+ * runtime/period below DL_BW_LIMIT so the set stays schedulable under
+ * EDF; the budget is enforced by arming the one-shot timer at the point
+ * the budget runs out, after which the thread is throttled until its next
+ * period begins. Deadline threads always run ahead of the fair class.
+ */
+
+#define DL_BW_LIMIT ((DL_BW_ONE * 95) / 100)
+/*
+ * Longest accepted period (~18 min). Keeps every time the class shifts
+ * into DL_BW_SHIFT fixed point, all bounded by the period, from
+ * overflowing, and absolute deadlines far from wrapping.
+ */
+#define DL_PERIOD_MAX_NS (1ull << 40)
+_Static_assert(40 + DL_BW_SHIFT < 64, "DL_PERIOD_MAX_NS");
+
+static inline int64_t tdiff(uint64_t a, uint64_t b) { return (int64_t)(a - b); }
+
+static inline dl_entity_t *node_dl(const rb_node_t *n) {
+    return rb_entry(n, dl_entity_t, node);
+}
+
+static inline thread_t *node_thread(rb_node_t *n) {
+    return rb_entry(n, thread_t, dl.node);
+}
+
+static int deadline_less(const rb_node_t *a, const rb_node_t *b) {
+    return tdiff(node_dl(a)->abs_deadline_ns, node_dl(b)->abs_deadline_ns) < 0;
+}
+
+static int curr_is_dl(const runqueue_t *rq) {
+    return rq->curr && rq->curr != rq->idle && dl_task(rq->curr);
+}
+
+int dl_admit(runqueue_t *rq, thread_t *t, uint64_t runtime_ns,
+             uint64_t deadline_ns, uint64_t period_ns) {
+    if (!runtime_ns || runtime_ns > deadline_ns || deadline_ns > period_ns ||
+        period_ns > DL_PERIOD_MAX_NS)
+        return -1;
+
+    uint64_t bw = (runtime_ns << DL_BW_SHIFT) / period_ns;
+    uint64_t old = (t->policy == SCHED_DEADLINE) ? t->dl.bw : 0;
+
+    if (rq->dl.total_bw - old + bw > DL_BW_LIMIT)
+        return -1;
+
+    rq->dl.total_bw = rq->dl.total_bw - old + bw;
+    t->dl.runtime_ns = runtime_ns;
+    t->dl.deadline_ns = deadline_ns;
+    t->dl.period_ns = period_ns;
+    t->dl.bw = bw;
+    return 0;
+}
+
+void dl_release(runqueue_t *rq, thread_t *t) {
+    if (t->policy != SCHED_DEADLINE)
+        return;
+    timerq_cancel(&t->dl.replenish);
+    rq->dl.total_bw -= t->dl.bw;
+    t->dl.bw = 0;
+    t->dl.throttled = 0;
+}
+
+static void dl_new_job(thread_t *t, uint64_t start) {
+    t->dl.abs_deadline_ns = start + t->dl.deadline_ns;
+    t->dl.remaining_ns = t->dl.runtime_ns;
+    t->dl.missed = 0;
+}
+
+static void dl_replenish_cb(void *arg) {
+    thread_t *t = (thread_t *)arg;
+    runqueue_t *rq = task_rq(t); // deadline threads never migrate
+    uint64_t now = timer_now_ns();
+
+    spin_lock(&rq->lock);
+    if (t->policy != SCHED_DEADLINE || !t->dl.throttled) {
+        spin_unlock(&rq->lock);
+        return;
+    }
+
+    t->dl.throttled = 0;
+    dl_new_job(t, now);
+
+    if (t->state == THREAD_READY) {
+        dl_enqueue(rq, t);
+        rq->seq++;
+        if (dl_wakeup_preempt(rq, t))
+            rq_resched(rq);
+    }
+    spin_unlock(&rq->lock);
+}
+
+/* budget exhausted: sit out until the next period starts */
+static void dl_throttle(thread_t *t) {
+    uint64_t period_start = t->dl.abs_deadline_ns - t->dl.deadline_ns;
+
+    t->dl.throttled = 1;
+    t->dl.replenish.deadline_ns = period_start + t->dl.period_ns;
+    t->dl.replenish.slack_ns = TIMER_SLACK_RT_NS;
+    t->dl.replenish.cb = dl_replenish_cb;
+    t->dl.replenish.arg = t;
+    timerq_insert(&t->dl.replenish);
+}
+
+void dl_update_curr(runqueue_t *rq, uint64_t now) {
+    if (!curr_is_dl(rq))
+        return;
+
+    thread_t *t = rq->curr;
+    if (t->policy != SCHED_DEADLINE)
+        return; // boosted: runs on the donor's deadline, no budget of its own
+
+    if (now > t->dl.exec_start_ns) {
+        uint64_t delta = now - t->dl.exec_start_ns;
+        t->dl.exec_start_ns = now;
+        t->dl.remaining_ns =
+            (delta >= t->dl.remaining_ns) ? 0 : t->dl.remaining_ns - delta;
+    }
+
+    if (!t->dl.missed && tdiff(now, t->dl.abs_deadline_ns) > 0) {
+        t->dl.missed = 1;
+        t->dl.misses++;
+    }
+
+    // a boosted thread holds a lock someone with a deadline waits for;
+    // throttling it would only make that wait longer
+    if (!t->dl.remaining_ns && !t->dl.throttled && !t->dl.boosted) {
+        dl_throttle(t);
+        rq_resched(rq);
+    }
+}
+
+/*
+ * CBS wakeup rule: keep the current job if its deadline is still ahead
+ * and the leftover budget would not exceed the reserved bandwidth over
+ * the time that remains; otherwise start a fresh job now.
+ */
+void dl_activate(runqueue_t *rq, thread_t *t, uint64_t now) {
+    (void)rq;
+    if (t->dl.throttled || t->policy != SCHED_DEADLINE)
+        return;
+
+    if (tdiff(t->dl.abs_deadline_ns, now) <= 0) {
+        dl_new_job(t, now);
+        return;
+    }
+
+    uint64_t left = t->dl.abs_deadline_ns - now;
+    uint64_t need = (t->dl.remaining_ns << DL_BW_SHIFT) / left;
+    uint64_t own = (t->dl.runtime_ns << DL_BW_SHIFT) / t->dl.deadline_ns;
+    if (need > own)
+        dl_new_job(t, now);
+}
+
+void dl_enqueue(runqueue_t *rq, thread_t *t) {
+    rb_insert_cached(&rq->dl.queue, &t->dl.node, deadline_less);
+    rq->dl.nr_queued++;
+}
+
+void dl_dequeue(runqueue_t *rq, thread_t *t) {
+    rb_erase_cached(&rq->dl.queue, &t->dl.node);
+    rq->dl.nr_queued--;
+}
+
+thread_t *dl_pick_next(runqueue_t *rq, uint64_t now) {
+    rb_node_t *n = rb_first_cached(&rq->dl.queue);
+    if (!n)
+        return 0;
+
+    thread_t *t = node_thread(n);
+    dl_dequeue(rq, t);
+    t->dl.exec_start_ns = now;
+    return t;
+}
+
+int dl_wakeup_preempt(runqueue_t *rq, thread_t *woken) {
+    if (!curr_is_dl(rq))
+        return 1;
+    return tdiff(woken->dl.abs_deadline_ns, rq->curr->dl.abs_deadline_ns) < 0;
+}
+
+/* absolute time curr runs out of budget, or 0 if curr is not deadline */
+uint64_t dl_budget_end(runqueue_t *rq, uint64_t now) {
+    if (!curr_is_dl(rq))
+        return 0;
+
+    thread_t *t = rq->curr;
+    if (t->policy != SCHED_DEADLINE || t->dl.boosted)
+        return 0;
+
+    uint64_t used = (now > t->dl.exec_start_ns) ? now - t->dl.exec_start_ns : 0;
+    return (used >= t->dl.remaining_ns) ? now
+                                        : now + (t->dl.remaining_ns - used);
+}
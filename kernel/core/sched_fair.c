@@ -0,0 +1,213 @@
+#include "sched_internal.h"
+
+/*
+ * Weighted fair class (CFS-style).
+ *
+ * Each thread accumulates vruntime = runtime * NICE_0_WEIGHT / weight, and
+ * the queued thread with the smallest vruntime runs next. The running
+ * thread is kept off the timeline. Slices split the latency target in
+ * proportion to weight; a thread waking from sleep is placed up to half a
+ * latency period behind min_vruntime so interactive threads get to run
+ * promptly without being able to bank unlimited credit.
+ */
+
+/* nice -20 .. 19, ~1.25x per step (same table as Linux) */
+static const uint32_t g_nice_weight[40] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,   335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+static uint64_t g_latency_ns = 0;
+static uint64_t g_min_gran_ns = 0;
+static uint64_t g_wakeup_gran_ns = 0;
+
+static inline int64_t vdiff(uint64_t a, uint64_t b) { return (int64_t)(a - b); }
+
+static inline fair_entity_t *node_fe(const rb_node_t *n) {
+    return rb_entry(n, fair_entity_t, node);
+}
+
+static inline thread_t *node_thread(rb_node_t *n) {
+    return rb_entry(n, thread_t, fair.node);
+}
+
+static int vruntime_less(const rb_node_t *a, const rb_node_t *b) {
+    return vdiff(node_fe(a)->vruntime, node_fe(b)->vruntime) < 0;
+}
+
+/* runtime scaled to nice-0 time */
+static inline uint64_t calc_delta_fair(uint64_t delta, uint32_t weight) {
+    if (weight == NICE_0_WEIGHT)
+        return delta;
+    return (delta * NICE_0_WEIGHT) / weight;
+}
+
+void fair_set_latency(uint64_t ns) {
+    g_latency_ns = ns;
+    g_min_gran_ns = ns / 8;
+    g_wakeup_gran_ns = ns / 5;
+}
+
+uint64_t fair_latency(void) { return g_latency_ns; }
+
+uint32_t fair_nice_to_weight(int nice) {
+    if (nice < NICE_MIN)
+        nice = NICE_MIN;
+    if (nice > NICE_MAX)
+        nice = NICE_MAX;
+    return g_nice_weight[nice - NICE_MIN];
+}
+
+static int curr_is_fair(const runqueue_t *rq) {
+    return rq->curr && rq->curr != rq->idle && !dl_task(rq->curr);
+}
+
+static void update_min_vruntime(runqueue_t *rq) {
+    fair_rq_t *f = &rq->fair;
+    rb_node_t *left = rb_first_cached(&f->timeline);
+    uint64_t v = f->min_vruntime;
+    int have = 0;
+
+    if (curr_is_fair(rq) && rq->curr->state == THREAD_RUNNING) {
+        v = rq->curr->fair.vruntime;
+        have = 1;
+    }
+    if (left) {
+        uint64_t lv = node_fe(left)->vruntime;
+        if (!have || vdiff(lv, v) < 0)
+            v = lv;
+        have = 1;
+    }
+
+    if (have && vdiff(v, f->min_vruntime) > 0)
+        f->min_vruntime = v;
+}
+
+void fair_update_curr(runqueue_t *rq, uint64_t now) {
+    if (!curr_is_fair(rq))
+        return;
+
+    fair_entity_t *fe = &rq->curr->fair;
+    if (now <= fe->exec_start_ns)
+        return;
+
+    uint64_t delta = now - fe->exec_start_ns;
+    fe->exec_start_ns = now;
+    fe->sum_exec_ns += delta;
+    fe->vruntime += calc_delta_fair(delta, fe->weight);
+
+    update_min_vruntime(rq);
+}
+
+void fair_enqueue(runqueue_t *rq, thread_t *t) {
+    fair_rq_t *f = &rq->fair;
+    rb_insert_cached(&f->timeline, &t->fair.node, vruntime_less);
+    f->load += t->fair.weight;
+    f->nr_queued++;
+}
+
+void fair_dequeue(runqueue_t *rq, thread_t *t) {
+    fair_rq_t *f = &rq->fair;
+    rb_erase_cached(&f->timeline, &t->fair.node);
+    f->load -= t->fair.weight;
+    f->nr_queued--;
+}
+
+/*
+ * New threads start at min_vruntime. Waking threads keep their own
+ * vruntime unless it fell further than latency/2 behind, which is the
+ * sleeper credit.
+ */
+void fair_place(runqueue_t *rq, thread_t *t, int wakeup) {
+    uint64_t v = rq->fair.min_vruntime;
+    if (wakeup)
+        v -= g_latency_ns / 2;
+    if (vdiff(t->fair.vruntime, v) < 0)
+        t->fair.vruntime = v;
+}
+
+thread_t *fair_pick_next(runqueue_t *rq, uint64_t now) {
+    fair_rq_t *f = &rq->fair;
+    rb_node_t *n = rb_first_cached(&f->timeline);
+    if (!n)
+        return 0;
+
+    if (f->skip && node_thread(n) == f->skip) {
+        rb_node_t *second = rb_next(n);
+        if (second)
+            n = second;
+    }
+    f->skip = 0;
+
+    thread_t *t = node_thread(n);
+    fair_dequeue(rq, t);
+
+    t->fair.exec_start_ns = now;
+    t->fair.slice_start_ns = t->fair.sum_exec_ns;
+    return t;
+}
+
+void fair_reweight(runqueue_t *rq, thread_t *t, uint32_t weight) {
+    if (t->state == THREAD_READY) {
+        rq->fair.load -= t->fair.weight;
+        rq->fair.load += weight;
+    }
+    t->fair.weight = weight;
+}
+
+/* keep t's lag behind min_vruntime when it changes queues */
+void fair_migrate(runqueue_t *src, runqueue_t *dst, thread_t *t) {
+    t->fair.vruntime =
+        t->fair.vruntime - src->fair.min_vruntime + dst->fair.min_vruntime;
+}
+
+/* queued weight plus curr's, what the balancer compares */
+uint64_t fair_rq_load(runqueue_t *rq) {
+    uint64_t load = rq->fair.load;
+    if (curr_is_fair(rq))
+        load += rq->curr->fair.weight;
+    return load;
+}
+
+/* period stretches once there are more threads than min_gran slots */
+static uint64_t fair_slice(runqueue_t *rq, thread_t *t) {
+    fair_rq_t *f = &rq->fair;
+    uint64_t nr = (uint64_t)f->nr_queued + 1;
+    uint64_t period = g_latency_ns;
+    if (g_min_gran_ns && nr * g_min_gran_ns > period)
+        period = nr * g_min_gran_ns;
+
+    uint64_t load = f->load + t->fair.weight;
+    uint64_t slice = (period * t->fair.weight) / load;
+    return slice < g_min_gran_ns ? g_min_gran_ns : slice;
+}
+
+/*
+ * Absolute time at which curr's slice runs out, or 0 if it may run on
+ * (nothing queued, or no latency target set).
+ */
+uint64_t fair_slice_end(runqueue_t *rq, uint64_t now) {
+    if (!g_latency_ns || !curr_is_fair(rq) || !rq->fair.nr_queued)
+        return 0;
+
+    thread_t *curr = rq->curr;
+    uint64_t ran = curr->fair.sum_exec_ns - curr->fair.slice_start_ns;
+    if (now > curr->fair.exec_start_ns)
+        ran += now - curr->fair.exec_start_ns;
+
+    uint64_t slice = fair_slice(rq, curr);
+    return (ran >= slice) ? now : now + (slice - ran);
+}
+
+int fair_wakeup_preempt(runqueue_t *rq, thread_t *woken) {
+    // idle always yields; a deadline thread is never preempted by fair
+    if (!rq->curr || rq->curr == rq->idle)
+        return 1;
+    if (dl_task(rq->curr))
+        return 0;
+
+    int64_t lead = vdiff(rq->curr->fair.vruntime, woken->fair.vruntime);
+    return lead > (int64_t)calc_delta_fair(g_wakeup_gran_ns, woken->fair.weight);
+}
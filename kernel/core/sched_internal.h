@@ -0,0 +1,92 @@
+#pragma once
+#include "hist.h"
+#include "rbtree.h"
+#include "sched.h"
+#include "spinlock.h"
+#include <stdint.h>
+
+/*
+ * Scheduler-private state. A runqueue and the threads queued on it are
+ * only touched with interrupts disabled and rq->lock held.
+ */
+
+#define NICE_0_WEIGHT 1024u
+
+typedef struct fair_rq {
+        rb_root_cached_t timeline; // queued threads keyed by vruntime
+        uint64_t min_vruntime;     // monotonic floor for placement
+        uint64_t load;             // sum of queued weights
+        uint32_t nr_queued;
+        thread_t *skip; // yielded, passed over by the next pick
+} fair_rq_t;
+
+/* utilization fixed point: 1 << DL_BW_SHIFT == one full cpu */
+#define DL_BW_SHIFT 20
+#define DL_BW_ONE (1ull << DL_BW_SHIFT)
+
+typedef struct dl_rq {
+        rb_root_cached_t queue; // runnable, unthrottled, by abs deadline
+        uint32_t nr_queued;
+        uint64_t total_bw; // admitted utilization
+} dl_rq_t;
+
+/* recorded on the pick path, under rq->lock */
+typedef struct sched_hists {
+        hist_t wakeup_lat; // wakeup -> on cpu, tsc ticks
+        hist_t slice;      // uninterrupted time on cpu, tsc ticks
+        hist_t depth;      // threads queued at each pick
+} sched_hists_t;
+
+typedef struct runqueue {
+        spinlock_t lock;
+        uint32_t cpu;
+        thread_t *curr;
+        thread_t *idle;
+        dl_rq_t dl;
+        fair_rq_t fair;
+        uint64_t resched_since_ns; // need_resched raised at
+        uint64_t max_latency_ns;   // worst need_resched -> switch delay
+        uint64_t next_balance_ns;
+        uint32_t balance_failed; // balance passes in a row that moved nothing
+        uint64_t curr_since_tsc; // curr switched in at
+        sched_hists_t hist;
+        /* bumped on every enqueue; the idle thread MONITORs this line */
+        volatile uint64_t seq __attribute__((aligned(64)));
+} runqueue_t;
+
+/* queued and picked by the deadline class: own reservation or PI boost */
+static inline int dl_task(const thread_t *t) {
+    return t->policy == SCHED_DEADLINE || t->dl.boosted;
+}
+
+runqueue_t *task_rq(thread_t *t);
+void rq_resched(runqueue_t *rq);
+
+void fair_set_latency(uint64_t ns);
+uint64_t fair_latency(void);
+uint32_t fair_nice_to_weight(int nice);
+
+void fair_update_curr(runqueue_t *rq, uint64_t now);
+void fair_enqueue(runqueue_t *rq, thread_t *t);
+void fair_dequeue(runqueue_t *rq, thread_t *t);
+void fair_place(runqueue_t *rq, thread_t *t, int wakeup);
+thread_t *fair_pick_next(runqueue_t *rq, uint64_t now);
+void fair_reweight(runqueue_t *rq, thread_t *t, uint32_t weight);
+void fair_migrate(runqueue_t *src, runqueue_t *dst, thread_t *t);
+uint64_t fair_rq_load(runqueue_t *rq);
+
+int fair_wakeup_preempt(runqueue_t *rq, thread_t *woken);
+uint64_t fair_slice_end(runqueue_t *rq, uint64_t now);
+
+int dl_admit(runqueue_t *rq, thread_t *t, uint64_t runtime_ns,
+             uint64_t deadline_ns, uint64_t period_ns);
+void dl_release(runqueue_t *rq, thread_t *t);
+
+void dl_update_curr(runqueue_t *rq, uint64_t now);
+void dl_activate(runqueue_t *rq, thread_t *t, uint64_t now);
+void dl_enqueue(runqueue_t *rq, thread_t *t);
+void dl_dequeue(runqueue_t *rq, thread_t *t);
+thread_t *dl_pick_next(runqueue_t *rq, uint64_t now);
+
+int dl_wakeup_preempt(runqueue_t *rq, thread_t *woken);
+uint64_t dl_budget_end(runqueue_t *rq, uint64_t now);
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Sequence counter for data read far more often than written. Readers
+ * never block the writer: they retry if a write overlapped. Writers must
+ * serialise among themselves. x86 keeps loads ordered with loads and
+ * stores with stores, so compiler barriers are enough.
+ */
+typedef struct seqcount {
+        volatile uint32_t seq; // odd while a write is in progress
+} seqcount_t;
+
+#define SEQCOUNT_INIT {0}
+
+#define seq_barrier() __asm__ volatile("" ::: "memory")
+
+static inline uint32_t read_seqcount_begin(const seqcount_t *s) {
+    uint32_t seq;
+    while ((seq = s->seq) & 1)
+        __asm__ volatile("pause" ::: "memory");
+    seq_barrier();
+    return seq;
+}
+
+static inline int read_seqcount_retry(const seqcount_t *s, uint32_t seq) {
+    seq_barrier();
+    return s->seq != seq;
+}
+
+static inline void write_seqcount_begin(seqcount_t *s) {
+    s->seq++;
+    seq_barrier();
+}
+
+static inline void write_seqcount_end(seqcount_t *s) {
+    seq_barrier();
+    s->seq++;
+}
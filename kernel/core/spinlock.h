@@ -0,0 +1,39 @@
+#pragma once
+#include "../arch/x86_64/cpu/irqflags.h"
+#include <stdint.h>
+
+/*
+ * Test-and-test-and-set lock. Holders must not sleep; take the _irqsave
+ * form if the lock is also taken from interrupt handlers.
+ */
+typedef struct spinlock {
+        volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT {0}
+
+static inline void spin_lock(spinlock_t *l) {
+    while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+            __asm__ volatile("pause" ::: "memory");
+    }
+}
+
+static inline int spin_trylock(spinlock_t *l) {
+    return !__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE);
+}
+
+static inline void spin_unlock(spinlock_t *l) {
+    __atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t spin_lock_irqsave(spinlock_t *l) {
+    uint64_t flags = cpu_irq_save();
+    spin_lock(l);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *l, uint64_t flags) {
+    spin_unlock(l);
+    cpu_irq_restore(flags);
+}
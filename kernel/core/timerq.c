@@ -1,24 +1,499 @@
 #include "timerq.h"
+#include "../arch/x86_64/cpu/cpu_local.h"
+#include "../arch/x86_64/cpu/relax.h"
+#include "sched.h"
+#include "spinlock.h"
 #include <stddef.h>
 
-static timer_event_t *g_head;
+#define TIMERQ_GRAN_SHIFT 20 // level 0 slot width, ~1.05 ms
+#define TIMERQ_LVL_BITS 6
+#define TIMERQ_SLOTS (1u << TIMERQ_LVL_BITS)
+#define TIMERQ_SLOT_MASK (TIMERQ_SLOTS - 1)
+#define TIMERQ_LEVELS 6 // top level spans 2^56 ns, about 2.3 years
+#define TIMERQ_BUCKETS (TIMERQ_LEVELS * TIMERQ_SLOTS)
+
+/* bucket of an event popped off a slot but not yet fired */
+#define TIMERQ_DETACHED 0xffffu
+
+/* granules beyond this are parked in the farthest top-level slot */
+#define TIMERQ_MAX_DELTA                                                       \
+    ((1ull << (TIMERQ_LVL_BITS * TIMERQ_LEVELS)) - 1)
+
+/*
+ * One wheel per cpu, run and armed by that cpu. Other cpus may add to or
+ * remove from it under its lock.
+ */
+typedef struct timer_base {
+        spinlock_t lock;
+        timer_event_t *slots[TIMERQ_BUCKETS];
+        uint64_t occupied[TIMERQ_LEVELS]; // non-empty slots, bit per slot
+        /* granule the wheel has been run up to; slots are relative to it */
+        uint64_t clk;
+        /* cached minimum hard deadline, recomputed lazily when stale */
+        uint64_t next_ns;
+        uint8_t next_valid;
+        uint32_t pending;
+        timer_event_t *running; // callback executing, for cancel_sync
+        timerq_stats_t stats;
+} timer_base_t;
+
+static timer_base_t g_bases[MAX_CPUS];
+
+static inline timer_base_t *cpu_base(uint32_t cpu) { return &g_bases[cpu]; }
+static inline uint32_t base_cpu(const timer_base_t *b) {
+    return (uint32_t)(b - g_bases);
+}
+
+static inline uint32_t lvl_shift(uint32_t lvl) { return lvl * TIMERQ_LVL_BITS; }
+
+static void list_push(timer_event_t **head, timer_event_t *ev,
+                      uint32_t bucket) {
+    ev->next = *head;
+    if (*head)
+        (*head)->pprev = &ev->next;
+    ev->pprev = head;
+    *head = ev;
+    ev->bucket = (uint16_t)bucket;
+}
+
+static void slot_push(timer_base_t *b, uint32_t bucket, timer_event_t *ev) {
+    list_push(&b->slots[bucket], ev, bucket);
+    b->occupied[bucket / TIMERQ_SLOTS] |= 1ull << (bucket % TIMERQ_SLOTS);
+}
+
+static void slot_unlink(timer_base_t *b, timer_event_t *ev) {
+    *ev->pprev = ev->next;
+    if (ev->next)
+        ev->next->pprev = ev->pprev;
+
+    uint32_t bucket = ev->bucket;
+    if (bucket != TIMERQ_DETACHED && !b->slots[bucket])
+        b->occupied[bucket / TIMERQ_SLOTS] &=
+            ~(1ull << (bucket % TIMERQ_SLOTS));
+
+    ev->next = NULL;
+    ev->pprev = NULL;
+}
+
+/* pick the level whose slot range covers the distance from b->clk */
+static void wheel_add(timer_base_t *b, timer_event_t *ev) {
+    uint64_t expires = ev->deadline_ns >> TIMERQ_GRAN_SHIFT;
+    if (expires < b->clk)
+        expires = b->clk; // overdue: next run fires it
+    uint64_t delta = expires - b->clk;
+    if (delta > TIMERQ_MAX_DELTA) {
+        delta = TIMERQ_MAX_DELTA;
+        expires = b->clk + delta;
+    }
+
+    uint32_t lvl = 0;
+    while (delta >> lvl_shift(lvl + 1))
+        lvl++;
+
+    uint32_t slot = (expires >> lvl_shift(lvl)) & TIMERQ_SLOT_MASK;
+    slot_push(b, lvl * TIMERQ_SLOTS + slot, ev);
+}
+
+/*
+ * Returns 1 if the base's cpu must look at its one-shot again: ev became
+ * its earliest hard deadline, or the earliest is not known. The cache is
+ * only recomputed when that cpu next programs its one-shot, which without
+ * a kick may be long after ev is due.
+ */
+static int timer_arm(timer_base_t *b, timer_event_t *ev) {
+    wheel_add(b, ev);
+    ev->cpu = (uint16_t)base_cpu(b);
+    b->pending++;
+    uint64_t hard = timer_hard_deadline(ev);
+    if (!b->next_valid)
+        return 1;
+    if (b->next_ns && hard >= b->next_ns)
+        return 0;
+    b->next_ns = hard;
+    return 1;
+}
+
+static void timer_detach(timer_base_t *b, timer_event_t *ev) {
+    slot_unlink(b, ev);
+    b->pending--;
+    if (timer_hard_deadline(ev) == b->next_ns)
+        b->next_valid = 0;
+}
+
+/* lock the base ev is queued on; ev->cpu only changes under that lock */
+static timer_base_t *lock_event_base(const timer_event_t *ev) {
+    for (;;) {
+        uint16_t cpu = __atomic_load_n(&ev->cpu, __ATOMIC_RELAXED);
+        timer_base_t *b = cpu_base(cpu);
+        spin_lock(&b->lock);
+        if (ev->cpu == cpu)
+            return b;
+        spin_unlock(&b->lock);
+    }
+}
+
+/* ev's current base and dst, in cpu order */
+static timer_base_t *lock_event_base_and(const timer_event_t *ev,
+                                        timer_base_t *dst) {
+    for (;;) {
+        uint16_t cpu = __atomic_load_n(&ev->cpu, __ATOMIC_RELAXED);
+        timer_base_t *b = cpu_base(cpu);
+        if (b == dst) {
+            spin_lock(&b->lock);
+        } else if (b < dst) {
+            spin_lock(&b->lock);
+            spin_lock(&dst->lock);
+        } else {
+            spin_lock(&dst->lock);
+            spin_lock(&b->lock);
+        }
+        if (ev->cpu == cpu)
+            return b;
+        spin_unlock(&b->lock);
+        if (b != dst)
+            spin_unlock(&dst->lock);
+    }
+}
+
+/*
+ * Queue ev on dst, moving it off whatever base holds it. A remote cpu is
+ * kicked if ev is now its earliest event, so it re-arms its one-shot.
+ * invalidate: ev->deadline_ns may already be the new one, so the old
+ * base's cached minimum can't be checked against it.
+ */
+static int timer_enqueue_on(timer_event_t *ev, uint32_t cpu, int invalidate) {
+    timer_base_t *dst = cpu_base(cpu);
+    timer_base_t *b = lock_event_base_and(ev, dst);
+    int pending = timerq_pending(ev);
+
+    if (pending) {
+        if (invalidate) {
+            slot_unlink(b, ev);
+            b->pending--;
+            b->next_valid = 0;
+        } else {
+            timer_detach(b, ev);
+        }
+    }
+    int earliest = timer_arm(dst, ev);
+
+    spin_unlock(&b->lock);
+    if (b != dst)
+        spin_unlock(&dst->lock);
+
+    if (earliest && cpu != this_cpu_id())
+        sched_kick(cpu);
+    return pending;
+}
 
 void timerq_insert(timer_event_t *ev) {
-    timer_event_t **pp = &g_head;
-    while (*pp && (*pp)->deadline_ns <= ev->deadline_ns)
-        pp = &(*pp)->next;
-    ev->next = *pp;
-    *pp = ev;
+    timer_enqueue_on(ev, this_cpu_id(), 1);
 }
 
-uint64_t timerq_next_deadline(void) { return g_head ? g_head->deadline_ns : 0; }
+void timerq_insert_on(timer_event_t *ev, uint32_t cpu) {
+    timer_enqueue_on(ev, cpu, 1);
+}
+
+int timerq_modify(timer_event_t *ev, uint64_t deadline_ns) {
+    timer_base_t *b = lock_event_base(ev);
+    if (!timerq_pending(ev)) {
+        ev->deadline_ns = deadline_ns;
+        spin_unlock(&b->lock);
+        timer_enqueue_on(ev, this_cpu_id(), 0);
+        return 0;
+    }
+
+    // stays on its cpu
+    timer_detach(b, ev);
+    ev->deadline_ns = deadline_ns;
+    int earliest = timer_arm(b, ev);
+    spin_unlock(&b->lock);
+
+    if (earliest && base_cpu(b) != this_cpu_id())
+        sched_kick(base_cpu(b));
+    return 1;
+}
+
+int timerq_migrate(timer_event_t *ev, uint32_t cpu) {
+    timer_base_t *dst = cpu_base(cpu);
+    timer_base_t *b = lock_event_base_and(ev, dst);
+    int moved = 0, earliest = 0;
+
+    // a periodic ev is re-armed before its callback: don't let it fire
+    // on dst while that callback still runs here
+    if (timerq_pending(ev) && b != dst && b->running != ev) {
+        timer_detach(b, ev);
+        earliest = timer_arm(dst, ev);
+        moved = 1;
+    }
+
+    spin_unlock(&b->lock);
+    if (b != dst)
+        spin_unlock(&dst->lock);
+
+    if (earliest && cpu != this_cpu_id())
+        sched_kick(cpu);
+    return moved;
+}
+
+int timerq_migrate_all(uint32_t from, uint32_t to) {
+    timer_base_t *src = cpu_base(from), *dst = cpu_base(to);
+    if (src == dst)
+        return 0;
+
+    spin_lock(&(src < dst ? src : dst)->lock);
+    spin_lock(&(src < dst ? dst : src)->lock);
+
+    int moved = 0, earliest = 0;
+    for (uint32_t lvl = 0; lvl < TIMERQ_LEVELS; lvl++) {
+        while (src->occupied[lvl]) {
+            uint32_t slot = (uint32_t)__builtin_ctzll(src->occupied[lvl]);
+            timer_event_t *ev = src->slots[lvl * TIMERQ_SLOTS + slot];
+            timer_detach(src, ev);
+            earliest |= timer_arm(dst, ev);
+            moved++;
+        }
+    }
+
+    spin_unlock(&dst->lock);
+    spin_unlock(&src->lock);
+
+    if (earliest && to != this_cpu_id())
+        sched_kick(to);
+    return moved;
+}
+
+int timerq_cancel(timer_event_t *ev) {
+    timer_base_t *b = lock_event_base(ev);
+    int pending = timerq_pending(ev);
+    if (pending)
+        timer_detach(b, ev);
+    spin_unlock(&b->lock);
+    return pending;
+}
+
+int timerq_cancel_sync(timer_event_t *ev) {
+    int pending = timerq_cancel(ev);
+
+    // the callback may have re-queued ev elsewhere, so look at every base;
+    // from inside its own callback there is nothing to wait for
+    uint32_t self = this_cpu_id();
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        if (cpu == self)
+            continue;
+        while (__atomic_load_n(&cpu_base(cpu)->running, __ATOMIC_ACQUIRE) ==
+               ev)
+            cpu_relax();
+    }
+    return pending;
+}
+
+/* occupancy of lvl rotated so bit 0 is slot `from` */
+static inline uint64_t occupied_from(const timer_base_t *b, uint32_t lvl,
+                                     uint32_t from) {
+    uint64_t occ = b->occupied[lvl];
+    return (occ >> from) | (from ? occ << (TIMERQ_SLOTS - from) : 0);
+}
+
+/* first occupied slot at lvl, scanning forward from slot `from` */
+static int first_slot_from(const timer_base_t *b, uint32_t lvl,
+                           uint32_t from) {
+    uint64_t rot = occupied_from(b, lvl, from);
+    if (!rot)
+        return -1;
+    return (int)((from + (uint32_t)__builtin_ctzll(rot)) & TIMERQ_SLOT_MASK);
+}
+
+/*
+ * Earliest hard deadline. Within a level, slots in wheel order from the
+ * current position hold strictly later ranges; on levels > 0 the slot
+ * under the cursor was cascaded already and can only hold events a full
+ * revolution out, so it comes last. A slot's start bounds the soft
+ * deadlines in it from below, and so the hard ones: once it passes the
+ * best hard deadline so far, the rest of the level can be skipped.
+ */
+static uint64_t wheel_min_deadline(const timer_base_t *b) {
+    uint64_t min = 0;
+    for (uint32_t lvl = 0; lvl < TIMERQ_LEVELS; lvl++) {
+        uint32_t shift = lvl_shift(lvl);
+        uint64_t first = (b->clk >> shift) + (lvl ? 1 : 0);
+        uint64_t rot =
+            occupied_from(b, lvl, (uint32_t)first & TIMERQ_SLOT_MASK);
+
+        while (rot) {
+            uint32_t k = (uint32_t)__builtin_ctzll(rot);
+            rot &= rot - 1;
+
+            uint64_t start_ns = ((first + k) << shift) << TIMERQ_GRAN_SHIFT;
+            if (min && start_ns >= min)
+                break;
+
+            uint32_t slot = (uint32_t)(first + k) & TIMERQ_SLOT_MASK;
+            for (timer_event_t *ev = b->slots[lvl * TIMERQ_SLOTS + slot]; ev;
+                 ev = ev->next) {
+                uint64_t hard = timer_hard_deadline(ev);
+                if (!min || hard < min)
+                    min = hard;
+            }
+        }
+    }
+    return min;
+}
+
+uint64_t timerq_next_deadline(void) {
+    timer_base_t *b = cpu_base(this_cpu_id());
+    spin_lock(&b->lock);
+    if (!b->next_valid) {
+        b->next_ns = b->pending ? wheel_min_deadline(b) : 0;
+        b->next_valid = 1;
+    }
+    uint64_t next = b->next_ns;
+    spin_unlock(&b->lock);
+    return next;
+}
+
+uint32_t timerq_nr_pending(uint32_t cpu) {
+    return __atomic_load_n(&cpu_base(cpu)->pending, __ATOMIC_RELAXED);
+}
+
+/*
+ * Earliest granule after b->clk at which a level-0 slot comes due or a
+ * coarser slot has to be cascaded.
+ */
+static uint64_t wheel_next_event(const timer_base_t *b) {
+    uint64_t next = UINT64_MAX;
+    for (uint32_t lvl = 0; lvl < TIMERQ_LEVELS; lvl++) {
+        uint64_t cur = b->clk >> lvl_shift(lvl);
+        int slot =
+            first_slot_from(b, lvl, (uint32_t)(cur + 1) & TIMERQ_SLOT_MASK);
+        if (slot < 0)
+            continue;
+        uint64_t ahead = ((uint32_t)slot - (cur + 1)) & TIMERQ_SLOT_MASK;
+        uint64_t at = (cur + 1 + ahead) << lvl_shift(lvl);
+        if (at < next)
+            next = at;
+    }
+    return next;
+}
+
+/* move every event of a slot down to where it belongs now */
+static void wheel_cascade(timer_base_t *b, uint32_t lvl) {
+    uint32_t slot = (uint32_t)(b->clk >> lvl_shift(lvl)) & TIMERQ_SLOT_MASK;
+    uint32_t bucket = lvl * TIMERQ_SLOTS + slot;
+
+    timer_event_t *ev = b->slots[bucket];
+    b->slots[bucket] = NULL;
+    b->occupied[lvl] &= ~(1ull << slot);
+
+    while (ev) {
+        timer_event_t *next = ev->next;
+        wheel_add(b, ev);
+        ev = next;
+    }
+}
+
+/*
+ * Re-arm a periodic ev at the first point of its grid after now. Missed
+ * periods are counted, not replayed. Left disarmed if the next point
+ * doesn't fit in 64 bits.
+ */
+static void timer_forward(timer_base_t *b, timer_event_t *ev, uint64_t now) {
+    uint64_t periods = (now - ev->deadline_ns) / ev->period_ns + 1;
+    uint64_t step, next;
+    if (__builtin_mul_overflow(periods, ev->period_ns, &step) ||
+        __builtin_add_overflow(ev->deadline_ns, step, &next))
+        return;
+
+    ev->deadline_ns = next;
+    ev->expired = periods > UINT32_MAX ? UINT32_MAX : (uint32_t)periods;
+    timer_arm(b, ev);
+}
+
+/*
+ * Fire everything due in the level-0 slot under the cursor. Events are
+ * taken off the slot one at a time and the lock is dropped around each
+ * callback, so callbacks (and other cpus meanwhile) may arm or cancel any
+ * event; anything armed here that is already due runs in this pass too.
+ * Events due later in the current granule are held aside and put back;
+ * the minimum scan cannot see them meanwhile, so the cache is dropped.
+ */
+static uint32_t wheel_fire_slot(timer_base_t *b, uint64_t now) {
+    timer_event_t **slot = &b->slots[(uint32_t)b->clk & TIMERQ_SLOT_MASK];
+    timer_event_t *later = NULL;
+    uint32_t fired = 0;
+
+    while (*slot) {
+        timer_event_t *ev = *slot;
+        slot_unlink(b, ev);
+        if (ev->deadline_ns > now) {
+            // private list: cancel still works through pprev
+            list_push(&later, ev, TIMERQ_DETACHED);
+            continue;
+        }
+        b->pending--;
+        b->next_valid = 0;
+        fired++;
+        ev->expired = 1;
+        if (ev->period_ns)
+            timer_forward(b, ev, now);
+        if (ev->cb) {
+            timer_cb_t cb = ev->cb;
+            void *arg = ev->arg;
+            __atomic_store_n(&b->running, ev, __ATOMIC_RELEASE);
+            spin_unlock(&b->lock);
+            cb(arg);
+            spin_lock(&b->lock);
+            // ev may be gone now; only its address is compared
+            __atomic_store_n(&b->running, NULL, __ATOMIC_RELEASE);
+        }
+    }
+
+    // a callback may have cached a minimum that could not see these
+    if (later)
+        b->next_valid = 0;
+    while (later) {
+        timer_event_t *ev = later;
+        slot_unlink(b, ev);
+        wheel_add(b, ev);
+    }
+    return fired;
+}
 
 void timerq_run_expired(uint64_t now) {
-    while (g_head && g_head->deadline_ns <= now) {
-        timer_event_t *ev = g_head;
-        g_head = ev->next;
-        ev->next = NULL;
-        if (ev->cb)
-            ev->cb(ev->arg);
+    timer_base_t *b = cpu_base(this_cpu_id());
+    uint64_t target = now >> TIMERQ_GRAN_SHIFT;
+    uint32_t fired = 0;
+
+    spin_lock(&b->lock);
+    for (;;) {
+        fired += wheel_fire_slot(b, now);
+        if (b->clk >= target)
+            break;
+
+        // jump straight over granules where nothing is due
+        uint64_t next = wheel_next_event(b);
+        b->clk = next < target ? next : target;
+
+        for (uint32_t lvl = 1; lvl < TIMERQ_LEVELS; lvl++) {
+            if (b->clk & ((1ull << lvl_shift(lvl)) - 1))
+                break;
+            wheel_cascade(b, lvl);
+        }
+    }
+
+    if (fired) {
+        b->stats.fired += fired;
+        b->stats.batches++;
+    }
+    spin_unlock(&b->lock);
+}
+
+/* summed over cpus; racy reads, good enough for a debug dump */
+void timerq_get_stats(timerq_stats_t *out) {
+    out->fired = 0;
+    out->batches = 0;
+    for (uint32_t cpu = 0; cpu < g_nr_cpus; cpu++) {
+        out->fired += cpu_base(cpu)->stats.fired;
+        out->batches += cpu_base(cpu)->stats.batches;
     }
 }
@@ -1,15 +1,100 @@
 #pragma once
 #include <stdint.h>
 
+/*
+ * Pending one-shot timer events, kept in a hierarchical timing wheel:
+ * TIMERQ_LEVELS levels of TIMERQ_SLOTS slots each, every level 64 times
+ * coarser than the one below. Arming and cancelling are O(1); slots of
+ * the coarser levels are cascaded down as time reaches them. Slots only
+ * bucket events, they fire at their exact deadline_ns.
+ *
+ * An event may fire anywhere in [deadline_ns, deadline_ns + slack_ns].
+ * The one-shot is programmed for the earliest end of such a window, and
+ * everything whose window has opened by then fires in the same interrupt.
+ *
+ * Every cpu has its own wheel, expired and armed from its own one-shot.
+ * Events are queued on the calling cpu, which for a thread arming its own
+ * timeout is where it blocks and most likely where it wakes. An idle cpu
+ * may hand its events to a busy one, so callbacks must not assume which
+ * cpu they run on.
+ *
+ * Callers keep interrupts disabled around every call. A runqueue lock may
+ * be held across any call; callbacks run with no timerq lock held.
+ */
+
 typedef void (*timer_cb_t)(void *arg);
 
+/* default slack per use; RT users get none */
+#define TIMER_SLACK_RT_NS 0ull
+#define TIMER_SLACK_SLEEP_NS 50000ull      // 50 us
+#define TIMER_SLACK_TIMEOUT_NS 1000000ull  // 1 ms, timeouts are rarely hit
+
 typedef struct timer_event {
-        uint64_t deadline_ns;
+        uint64_t deadline_ns; // fire no earlier than
+        uint64_t slack_ns;    // ... and no later than deadline_ns + slack_ns
+        /*
+         * Nonzero: re-armed for deadline_ns + k * period_ns, the first such
+         * point after the expiry, before cb runs. Stays on its original
+         * grid however late it fires.
+         */
+        uint64_t period_ns;
         timer_cb_t cb;
         void *arg;
+        /* wheel linkage, zero while not queued */
         struct timer_event *next;
+        struct timer_event **pprev;
+        uint16_t bucket;
+        uint16_t cpu;     // whose wheel, valid while queued
+        uint32_t expired; // periods covered by this firing, for cb
 } timer_event_t;
 
+/*
+ * (re)arm ev for ev->deadline_ns; a queued ev is moved. deadline_ns must
+ * not change while ev is queued other than right before this call.
+ */
 void timerq_insert(timer_event_t *ev);
+/* as timerq_insert(), on cpu's wheel; cpu is kicked if it must re-arm */
+void timerq_insert_on(timer_event_t *ev, uint32_t cpu);
+/* rearm for a new deadline on the same cpu; returns 1 if ev was pending */
+int timerq_modify(timer_event_t *ev, uint64_t deadline_ns);
+/* returns 1 if ev was pending, 0 if it already fired or was never armed */
+int timerq_cancel(timer_event_t *ev);
+/*
+ * Like timerq_cancel(), and also waits for ev's callback if it is running
+ * on another cpu, so ev and whatever the callback touches can be freed
+ * afterwards. The callback must not wait on the caller.
+ */
+int timerq_cancel_sync(timer_event_t *ev);
+
+/* move a pending ev to cpu's wheel; returns 1 if it moved */
+int timerq_migrate(timer_event_t *ev, uint32_t cpu);
+/*
+ * Move every event queued on cpu `from` to cpu `to`. `from` must not be
+ * expiring its wheel meanwhile: the caller itself, or offline. Returns the
+ * number of events moved.
+ */
+int timerq_migrate_all(uint32_t from, uint32_t to);
+
+static inline int timerq_pending(const timer_event_t *ev) {
+    return ev->pprev != 0;
+}
+
+static inline uint64_t timer_hard_deadline(const timer_event_t *ev) {
+    uint64_t hard = ev->deadline_ns + ev->slack_ns;
+    return hard < ev->deadline_ns ? UINT64_MAX : hard;
+}
+
+/* how well expiries are being batched */
+typedef struct timerq_stats {
+        uint64_t fired;   // events run
+        uint64_t batches; // expiry passes that ran at least one
+} timerq_stats_t;
+
+void timerq_get_stats(timerq_stats_t *out);
+
+/* this cpu's earliest hard deadline (deadline + slack); 0 if none */
 uint64_t timerq_next_deadline(void);
+/* fire this cpu's events due by now */
 void timerq_run_expired(uint64_t now);
+/* events queued on cpu; racy, a hint */
+uint32_t timerq_nr_pending(uint32_t cpu);
@@ -0,0 +1,139 @@
+#include "utimer.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "futex.h"
+#include "mutex.h"
+#include "pmm.h"
+#include "timerq.h"
+#include "uaccess.h"
+#include "vmm.h"
+#include <stddef.h>
+
+/*
+ * Timers live in page-sized chunks that are allocated as needed and never
+ * given back; free ones are kept on a list. A handle is the slot number
+ * plus one in its low 16 bits and the slot's reuse count above, so a
+ * stale handle doesn't reach the slot's next owner.
+ */
+#define UTIMER_MAX_CHUNKS 256
+#define UTIMER_SLOT_BITS 16
+#define UTIMER_SLOT_MASK ((1u << UTIMER_SLOT_BITS) - 1)
+
+typedef struct utimer {
+        timer_event_t ev;
+        uint64_t handle; // 0 while free
+        uint64_t space;  // owner's pml4 phys
+        uint64_t word_phys;
+        uint32_t slot;
+        uint32_t gen;
+        struct utimer *free_next;
+} utimer_t;
+
+#define UTIMERS_PER_CHUNK (PAGE_SIZE / sizeof(utimer_t))
+
+static mutex_t g_pool_lock = MUTEX_INIT;
+static utimer_t *g_chunks[UTIMER_MAX_CHUNKS];
+static uint32_t g_nr_chunks;
+static utimer_t *g_free;
+
+/* add one chunk to the free list; pool lock held */
+static int utimer_grow(void) {
+    if (g_nr_chunks == UTIMER_MAX_CHUNKS)
+        return -1;
+    void *phys = pmm_alloc_pages(1);
+    if (!phys)
+        return -1;
+
+    utimer_t *chunk = (utimer_t *)phys_to_virt((uint64_t)phys);
+    uint8_t *p = (uint8_t *)chunk;
+    for (size_t i = 0; i < PAGE_SIZE; i++)
+        p[i] = 0;
+
+    uint32_t first = g_nr_chunks * (uint32_t)UTIMERS_PER_CHUNK;
+    g_chunks[g_nr_chunks++] = chunk;
+    for (size_t i = UTIMERS_PER_CHUNK; i-- > 0;) {
+        chunk[i].slot = first + (uint32_t)i;
+        chunk[i].free_next = g_free;
+        g_free = &chunk[i];
+    }
+    return 0;
+}
+
+/* pool lock held */
+static utimer_t *utimer_lookup(uint64_t handle) {
+    uint32_t slot = (uint32_t)(handle & UTIMER_SLOT_MASK);
+    if (!slot--)
+        return NULL;
+    uint32_t c = slot / (uint32_t)UTIMERS_PER_CHUNK;
+    if (c >= g_nr_chunks)
+        return NULL;
+
+    utimer_t *ut = &g_chunks[c][slot % UTIMERS_PER_CHUNK];
+    if (ut->handle != handle || ut->space != vmm_current_space().pml4_phys)
+        return NULL;
+    return ut;
+}
+
+/* timer callback, any cpu, interrupt context */
+static void utimer_fire(void *arg) {
+    utimer_t *ut = (utimer_t *)arg;
+    uint32_t *word = (uint32_t *)phys_to_virt(ut->word_phys);
+    __atomic_fetch_add(word, ut->ev.expired, __ATOMIC_RELEASE);
+    futex_wake_phys(ut->space, ut->word_phys, UINT32_MAX);
+}
+
+int64_t utimer_create(uint64_t first_ns, uint64_t period_ns, uint64_t uword) {
+    if (period_ns && period_ns < UTIMER_MIN_PERIOD_NS)
+        return -1;
+
+    uint64_t word_phys;
+    if ((uword & 3) || uaccess_resolve(uword, 1, &word_phys) < 0)
+        return -1;
+
+    mutex_lock(&g_pool_lock);
+    if (!g_free && utimer_grow() < 0) {
+        mutex_unlock(&g_pool_lock);
+        return -1;
+    }
+    utimer_t *ut = g_free;
+    g_free = ut->free_next;
+
+    ut->gen++;
+    ut->handle = ((uint64_t)ut->gen << UTIMER_SLOT_BITS) | (ut->slot + 1);
+    ut->space = vmm_current_space().pml4_phys;
+    ut->word_phys = word_phys;
+    ut->free_next = NULL;
+
+    ut->ev.deadline_ns = first_ns;
+    ut->ev.period_ns = period_ns;
+    ut->ev.slack_ns = TIMER_SLACK_SLEEP_NS;
+    ut->ev.cb = utimer_fire;
+    ut->ev.arg = ut;
+    int64_t handle = (int64_t)ut->handle;
+
+    // armed on this cpu, where the thread that will wait most likely runs
+    uint64_t flags = cpu_irq_save();
+    timerq_insert(&ut->ev);
+    cpu_irq_restore(flags);
+
+    mutex_unlock(&g_pool_lock);
+    return handle;
+}
+
+int utimer_destroy(uint64_t handle) {
+    mutex_lock(&g_pool_lock);
+    utimer_t *ut = utimer_lookup(handle);
+    if (!ut) {
+        mutex_unlock(&g_pool_lock);
+        return -1;
+    }
+
+    uint64_t flags = cpu_irq_save();
+    timerq_cancel_sync(&ut->ev);
+    cpu_irq_restore(flags);
+
+    ut->handle = 0;
+    ut->free_next = g_free;
+    g_free = ut;
+    mutex_unlock(&g_pool_lock);
+    return 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Timers owned by user space. Each expiry adds to a 32-bit notification
+ * word in the owner's memory and futex-wakes it, so a thread can check
+ * for expiries with a plain load, collect them with an atomic exchange
+ * against 0, and sleep with futex_wait() on the value it saw. Periodic
+ * timers are re-armed by the timer queue itself on a fixed grid, with no
+ * syscall per period; periods missed while nobody looked are added in
+ * one go.
+ *
+ * The word's page must stay mapped as long as the timer exists.
+ */
+
+#define UTIMER_MIN_PERIOD_NS 10000ull // 10 us, bounds the interrupt rate
+
+/*
+ * first_ns is absolute timer_now_ns() time; period_ns 0 makes a one-shot.
+ * Returns a positive handle, or -1 for a bad word, a too short period or
+ * no memory.
+ */
+int64_t utimer_create(uint64_t first_ns, uint64_t period_ns, uint64_t uword);
+
+/* stop and free a timer of the calling address space; 0 or -1 */
+int utimer_destroy(uint64_t handle);
@@ -0,0 +1,129 @@
+#include "waitq.h"
+#include "../arch/x86_64/cpu/irqflags.h"
+#include "../arch/x86_64/cpu/timer.h"
+#include <stddef.h>
+
+void waitq_init(waitq_t *wq) {
+    wq->lock = (spinlock_t)SPINLOCK_INIT;
+    wq->head = NULL;
+    wq->tail = NULL;
+}
+
+static void waitq_append(waitq_t *wq, waitq_entry_t *e) {
+    e->next = NULL;
+    e->queued = 1;
+    if (wq->tail)
+        wq->tail->next = e;
+    else
+        wq->head = e;
+    wq->tail = e;
+}
+
+static waitq_entry_t *waitq_pop(waitq_t *wq) {
+    waitq_entry_t *e = wq->head;
+    if (!e)
+        return NULL;
+    wq->head = e->next;
+    if (!wq->head)
+        wq->tail = NULL;
+    e->queued = 0;
+    return e;
+}
+
+static void waitq_remove(waitq_t *wq, waitq_entry_t *e) {
+    waitq_entry_t *prev = NULL;
+    for (waitq_entry_t *it = wq->head; it; prev = it, it = it->next) {
+        if (it != e)
+            continue;
+        if (prev)
+            prev->next = e->next;
+        else
+            wq->head = e->next;
+        if (wq->tail == e)
+            wq->tail = prev;
+        e->queued = 0;
+        return;
+    }
+}
+
+static void waitq_timeout_cb(void *arg) { sched_wakeup((thread_t *)arg); }
+
+int waitq_wait_until(waitq_t *wq, waitq_cond_t cond, void *arg,
+                     uint64_t deadline_ns) {
+    thread_t *self = sched_current();
+    waitq_entry_t e = {.t = self};
+
+    for (;;) {
+        // irqs stay off from BLOCKED until schedule(), or a preemption in
+        // between would take us off the cpu for good
+        uint64_t flags = spin_lock_irqsave(&wq->lock);
+
+        if (cond && cond(arg)) {
+            spin_unlock_irqrestore(&wq->lock, flags);
+            return 0;
+        }
+        if (deadline_ns && timer_now_ns() >= deadline_ns) {
+            spin_unlock_irqrestore(&wq->lock, flags);
+            return -1;
+        }
+
+        waitq_append(wq, &e);
+        self->state = THREAD_BLOCKED;
+        self->block_reason = BLOCK_WAITQ;
+        spin_unlock(&wq->lock);
+
+        if (deadline_ns) {
+            e.timeout.deadline_ns = deadline_ns;
+            e.timeout.slack_ns = TIMER_SLACK_TIMEOUT_NS;
+            e.timeout.cb = waitq_timeout_cb;
+            e.timeout.arg = self;
+            timerq_insert(&e.timeout);
+        }
+
+        schedule();
+
+        if (deadline_ns)
+            timerq_cancel_sync(&e.timeout);
+
+        spin_lock(&wq->lock);
+        int woken = !e.queued;
+        if (e.queued)
+            waitq_remove(wq, &e);
+        int done = !cond || cond(arg);
+        spin_unlock_irqrestore(&wq->lock, flags);
+
+        if (done)
+            return 0;
+
+        // leaving with a wakeup meant for someone: pass it along
+        if (deadline_ns && timer_now_ns() >= deadline_ns) {
+            if (woken)
+                waitq_wake_one(wq);
+            return -1;
+        }
+    }
+}
+
+/*
+ * Waking happens under wq->lock: entries live on the waiters' stacks and
+ * a waiter can't get past its own re-lock until we are done with it.
+ */
+int waitq_wake_one(waitq_t *wq) {
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    waitq_entry_t *e = waitq_pop(wq);
+    if (e)
+        sched_wakeup(e->t);
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return e != NULL;
+}
+
+uint32_t waitq_wake_all(waitq_t *wq) {
+    uint32_t n = 0;
+    uint64_t flags = spin_lock_irqsave(&wq->lock);
+    for (waitq_entry_t *e = waitq_pop(wq); e; e = waitq_pop(wq)) {
+        sched_wakeup(e->t);
+        n++;
+    }
+    spin_unlock_irqrestore(&wq->lock, flags);
+    return n;
+}
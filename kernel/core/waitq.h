@@ -0,0 +1,48 @@
+#pragma once
+#include "sched.h"
+#include "spinlock.h"
+#include <stdint.h>
+
+/*
+ * FIFO wait queue. Waiters sleep until a condition they pass in holds;
+ * the condition is re-checked under the queue lock before blocking, so a
+ * wakeup between "check" and "sleep" is never lost.
+ */
+
+typedef int (*waitq_cond_t)(void *arg);
+
+typedef struct waitq_entry {
+        thread_t *t;
+        struct waitq_entry *next;
+        uint8_t queued; // cleared by the waker that dequeued it
+        timer_event_t timeout;
+} waitq_entry_t;
+
+typedef struct waitq {
+        spinlock_t lock;
+        waitq_entry_t *head;
+        waitq_entry_t *tail;
+} waitq_t;
+
+#define WAITQ_INIT {SPINLOCK_INIT, 0, 0}
+
+void waitq_init(waitq_t *wq);
+
+/*
+ * Sleep until cond(arg) is true (checked under wq->lock), or until one
+ * wakeup if cond is NULL. deadline_ns is absolute timer_now_ns() time, 0
+ * for none. Returns 0 on success, -1 on timeout.
+ */
+int waitq_wait_until(waitq_t *wq, waitq_cond_t cond, void *arg,
+                     uint64_t deadline_ns);
+
+static inline void waitq_wait(waitq_t *wq, waitq_cond_t cond, void *arg) {
+    waitq_wait_until(wq, cond, arg, 0);
+}
+
+/*
+ * Wake the longest waiter only: a single resource handed to a single
+ * thread instead of a herd racing for it. Returns 1 if anyone was woken.
+ */
+int waitq_wake_one(waitq_t *wq);
+uint32_t waitq_wake_all(waitq_t *wq);
@@ -0,0 +1,80 @@
+#include "kstack.h"
+#include "core/panic.h"
+#include "core/preempt.h"
+#include "pmm.h"
+#include "vmm.h"
+
+/*
+ * Freed stacks are kept mapped and chained through their lowest word, so
+ * creating a thread from the pool is a list pop. Slots are only handed out
+ * fresh once the pool is empty.
+ */
+static uint64_t g_free_head; // top of the most recently freed stack
+static uint64_t g_next_slot;
+
+static inline uint64_t slot_base(uint64_t slot) {
+    return KSTACK_REGION_BASE + slot * KSTACK_SLOT_SIZE;
+}
+
+static inline uint64_t *free_link(uint64_t top) {
+    return (uint64_t *)(top - KSTACK_SIZE);
+}
+
+static uint64_t kstack_map_slot(uint64_t slot) {
+    uint64_t stack = slot_base(slot) + 4096; // skip the guard
+
+    for (uint64_t i = 0; i < KSTACK_PAGES; i++) {
+        void *phys = pmm_alloc_pages(1);
+        if (!phys ||
+            vmm_map_page(stack + i * 4096, (uint64_t)phys,
+                         VMM_FLAG_WRITE | VMM_FLAG_NOEXEC)) {
+            if (phys)
+                pmm_free_pages(phys, 1);
+            // earlier pages stay mapped; the slot is simply lost
+            return 0;
+        }
+    }
+    return stack + KSTACK_SIZE;
+}
+
+void kstack_init(void) {
+    uint64_t top = kstack_alloc();
+    if (!top)
+        panic("kstack: cannot populate stack region");
+    kstack_free(top);
+}
+
+uint64_t kstack_alloc(void) {
+    preempt_disable();
+
+    uint64_t top = g_free_head;
+    if (top) {
+        g_free_head = *free_link(top);
+        preempt_enable();
+        return top;
+    }
+
+    // the page tables have no lock of their own
+    if (g_next_slot < KSTACK_MAX_SLOTS)
+        top = kstack_map_slot(g_next_slot++);
+
+    preempt_enable();
+    return top;
+}
+
+void kstack_free(uint64_t top) {
+    if (!top)
+        return;
+
+    preempt_disable();
+    *free_link(top) = g_free_head;
+    g_free_head = top;
+    preempt_enable();
+}
+
+int kstack_is_guard(uint64_t addr) {
+    if (addr < KSTACK_REGION_BASE ||
+        addr >= KSTACK_REGION_BASE + KSTACK_MAX_SLOTS * KSTACK_SLOT_SIZE)
+        return 0;
+    return (addr - KSTACK_REGION_BASE) % KSTACK_SLOT_SIZE < 4096;
+}
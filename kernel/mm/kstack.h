@@ -0,0 +1,45 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Kernel stacks live in their own VA region, one fixed-size slot each:
+ *
+ *   slot base -> guard page (never mapped)
+ *                KSTACK_PAGES mapped pages
+ *   slot top  ->
+ *
+ * Running off the bottom of a stack faults on the guard page instead of
+ * corrupting whatever sits next to it. Interrupt handlers run on a per-cpu
+ * IRQ stack, so a thread stack only needs room for syscalls plus one
+ * interrupt frame.
+ */
+#define KSTACK_REGION_BASE 0xfffffe0000000000ull
+#define KSTACK_PAGES 2ull
+#define KSTACK_SIZE (KSTACK_PAGES * 4096ull)
+#define KSTACK_SLOT_SIZE (KSTACK_SIZE + 4096ull)
+#define KSTACK_MAX_SLOTS 4096ull
+
+/**
+ * @brief Reserve the region and populate the first slot.
+ *
+ * Must run before any address space is created from the kernel half so
+ * the region's top-level entry is shared by all of them.
+ */
+void kstack_init(void);
+
+/**
+ * @brief Get a kernel stack, reusing a freed one if possible.
+ *
+ * @return stack top (16-byte aligned), or 0 on failure.
+ */
+uint64_t kstack_alloc(void);
+
+/**
+ * @brief Return a stack to the pool. Its pages stay mapped for reuse.
+ */
+void kstack_free(uint64_t top);
+
+/**
+ * @brief Whether addr falls on a guard page of the stack region.
+ */
+int kstack_is_guard(uint64_t addr);
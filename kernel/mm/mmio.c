@@ -1,6 +1,5 @@
 #include "mmio.h"
 #include "../boot/boot_info.h"
-#include "immintrin.h"
 #include "vmm.h"
 #include <stdint.h>
 
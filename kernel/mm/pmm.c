@@ -1,5 +1,6 @@
 #include "pmm.h"
 #include "boot/boot_info.h"
+#include "core/preempt.h"
 #include <limine.h>
 #include <stdint.h>
 
@@ -14,12 +15,16 @@ extern uint8_t __kernel_end;
 /* 4KiB pages for now */
 #define PAGE_SIZE 4096ull
 
+/* pages scanned between preemption points in pmm_alloc_pages */
+#define PMM_SCAN_BATCH 4096ull
+
 static uint64_t g_hhdm = 0;
 static uint8_t *g_bitmap = 0;
 static uint64_t g_bitmap_bytes;
 static uint64_t g_total_bytes;
 static uint64_t g_free_bytes;
 static uint64_t g_total_pages = 0;
+static uint64_t g_gen; // bumped on every bitmap update
 
 static uint64_t align_down(uint64_t x, uint64_t a) { return x & ~(a - 1); }
 static uint64_t align_up(uint64_t x, uint64_t a) {
@@ -163,6 +168,12 @@ void pmm_init(void) {
     g_free_bytes = free_pages * PAGE_SIZE;
 }
 
+/*
+ * First-fit scan. The bitmap is only touched with preemption disabled, but
+ * a long scan drops out of the critical section every PMM_SCAN_BATCH pages
+ * so other threads are not held up; if the bitmap changed meanwhile the
+ * current run may no longer be free and is started over.
+ */
 void *pmm_alloc_pages(size_t page_count) {
     if (page_count == 0)
         return 0;
@@ -170,7 +181,16 @@ void *pmm_alloc_pages(size_t page_count) {
     uint64_t run = 0;
     uint64_t run_start = 0;
 
+    preempt_disable();
     for (uint64_t i = 0; i < g_total_pages; i++) {
+        if (i && (i % PMM_SCAN_BATCH) == 0 && need_resched()) {
+            uint64_t gen = g_gen;
+            preempt_enable();
+            preempt_disable();
+            if (gen != g_gen)
+                run = 0;
+        }
+
         if (!bitmap_test(i)) {
             if (run == 0)
                 run_start = i;
@@ -179,12 +199,15 @@ void *pmm_alloc_pages(size_t page_count) {
                 for (uint64_t j = 0; j < page_count; j++)
                     bitmap_set(run_start + j);
                 g_free_bytes -= (uint64_t)page_count * PAGE_SIZE;
+                g_gen++;
+                preempt_enable();
                 return (void *)(run_start * PAGE_SIZE);
             }
         } else {
             run = 0;
         }
     }
+    preempt_enable();
     return 0;
 }
 
@@ -194,12 +217,15 @@ void pmm_free_pages(void *phys, size_t pages) {
     uint64_t base = (uint64_t)phys;
     uint64_t start = base / PAGE_SIZE;
 
+    preempt_disable();
     for (uint64_t i = 0; i < pages; i++) {
         uint64_t idx = start + i;
         if (idx < g_total_pages)
             bitmap_clear(idx);
     }
     g_free_bytes += (uint64_t)pages * PAGE_SIZE;
+    g_gen++;
+    preempt_enable();
 }
 
 uint64_t pmm_total_bytes(void) { return g_total_bytes; }
@@ -0,0 +1,68 @@
+#include "uaccess.h"
+#include "pmm.h"
+#include "vmm.h"
+
+int uaccess_resolve(uint64_t uaddr, int write, uint64_t *phys) {
+    if (!uaccess_range_ok(uaddr, 1))
+        return -1;
+
+    uint64_t flags;
+    if (vmm_translate(uaddr, phys, &flags) < 0)
+        return -1;
+    if (!(flags & PTE_U))
+        return -1;
+    if (write && !(flags & PTE_W))
+        return -1;
+    return 0;
+}
+
+int copy_to_user(uint64_t udst, const void *src, uint64_t len) {
+    if (!uaccess_range_ok(udst, len))
+        return -1;
+
+    const uint8_t *s = (const uint8_t *)src;
+    while (len) {
+        uint64_t phys;
+        if (uaccess_resolve(udst, 1, &phys) < 0)
+            return -1;
+
+        uint64_t chunk = PAGE_SIZE - (udst & (PAGE_SIZE - 1));
+        if (chunk > len)
+            chunk = len;
+
+        // through the direct map, so a bad pointer can't fault the kernel
+        uint8_t *d = (uint8_t *)phys_to_virt(phys);
+        for (uint64_t i = 0; i < chunk; i++)
+            d[i] = s[i];
+
+        udst += chunk;
+        s += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+int copy_from_user(void *dst, uint64_t usrc, uint64_t len) {
+    if (!uaccess_range_ok(usrc, len))
+        return -1;
+
+    uint8_t *d = (uint8_t *)dst;
+    while (len) {
+        uint64_t phys;
+        if (uaccess_resolve(usrc, 0, &phys) < 0)
+            return -1;
+
+        uint64_t chunk = PAGE_SIZE - (usrc & (PAGE_SIZE - 1));
+        if (chunk > len)
+            chunk = len;
+
+        const uint8_t *s = (const uint8_t *)phys_to_virt(phys);
+        for (uint64_t i = 0; i < chunk; i++)
+            d[i] = s[i];
+
+        usrc += chunk;
+        d += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
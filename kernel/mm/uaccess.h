@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+
+/* first address above the lower canonical half */
+#define USER_TOP 0x0000800000000000ull
+
+/**
+ * @brief Check that [uaddr, uaddr + len) lies entirely in user space.
+ *
+ * Says nothing about whether the range is mapped.
+ */
+static inline int uaccess_range_ok(uint64_t uaddr, uint64_t len) {
+    return uaddr < USER_TOP && len <= USER_TOP - uaddr;
+}
+
+/**
+ * @brief Resolve a user address to its physical address in the current
+ * address space.
+ *
+ * Fails unless the page is present and user accessible (and writable when
+ * write is set), so the kernel never touches memory the caller could not.
+ *
+ * @return 0 on success, -1 otherwise.
+ */
+int uaccess_resolve(uint64_t uaddr, int write, uint64_t *phys);
+
+/**
+ * @brief Copy len bytes to user memory, page by page.
+ *
+ * @return 0 on success, -1 if any destination page is not user writable
+ * (bytes before it may already have been written).
+ */
+int copy_to_user(uint64_t udst, const void *src, uint64_t len);
+
+/**
+ * @brief Copy len bytes from user memory, page by page.
+ *
+ * @return 0 on success, -1 if any source page is not user readable
+ * (bytes before it may already have been copied).
+ */
+int copy_from_user(void *dst, uint64_t usrc, uint64_t len);
@@ -40,6 +40,18 @@ static inline uint16_t idx_pt(uint64_t va) { return (va >> 12) & 0x1ff; }
 
 static uint64_t g_kernel_cr3_phys = 0;
 
+#define VMM_SHARED_MAX 4
+
+/* pages mapped into every user address space */
+static struct {
+        uint64_t virt;
+        uint64_t phys;
+} g_shared[VMM_SHARED_MAX];
+static uint32_t g_nr_shared = 0;
+static int g_spaces_created = 0; // g_shared is frozen from then on
+
+#define VMM_SHARED_FLAGS (PTE_U | PTE_NX)
+
 /*
  * VMM assumes:
  * - all page table pages are allocated from PMM
@@ -203,6 +215,33 @@ void vmm_init(void) {
     kprint("[vmm] init ok\n");
 }
 
+#define PTE_ADDR_MASK 0x000ffffffffff000ull
+
+/*
+ * Free the user half's page tables of a space, and the PML4. Leaf frames
+ * are left alone: the caller owns them.
+ */
+static void free_user_tables(uint64_t pml4_phys) {
+    uint64_t *pml4 = pt_virt(pml4_phys);
+    for (size_t i4 = 0; i4 < 256; i4++) {
+        if (!(pml4[i4] & PTE_P))
+            continue;
+        uint64_t *pdpt = pt_virt(pml4[i4] & PTE_ADDR_MASK);
+        for (size_t i3 = 0; i3 < 512; i3++) {
+            if (!(pdpt[i3] & PTE_P) || (pdpt[i3] & PTE_PS))
+                continue;
+            uint64_t *pd = pt_virt(pdpt[i3] & PTE_ADDR_MASK);
+            for (size_t i2 = 0; i2 < 512; i2++) {
+                if ((pd[i2] & PTE_P) && !(pd[i2] & PTE_PS))
+                    pmm_free_pages((void *)(pd[i2] & PTE_ADDR_MASK), 1);
+            }
+            pmm_free_pages((void *)(pdpt[i3] & PTE_ADDR_MASK), 1);
+        }
+        pmm_free_pages((void *)(pml4[i4] & PTE_ADDR_MASK), 1);
+    }
+    pmm_free_pages((void *)pml4_phys, 1);
+}
+
 vmm_space_t vmm_create_space(void) {
     uint64_t new_pml4 = alloc_pt_page_phys();
     if (!new_pml4)
@@ -213,11 +252,62 @@ vmm_space_t vmm_create_space(void) {
     for (size_t i = 256; i < 512; i++)
         dst[i] = src[i];
 
+    for (uint32_t i = 0; i < g_nr_shared; i++) {
+        if (vmm_map_page_cr3(new_pml4, g_shared[i].virt, g_shared[i].phys,
+                             VMM_SHARED_FLAGS)) {
+            free_user_tables(new_pml4);
+            return (vmm_space_t){0};
+        }
+    }
+
+    g_spaces_created = 1;
     return (vmm_space_t){.pml4_phys = new_pml4};
 }
 
+int vmm_add_shared_user_page(uint64_t virt, uint64_t phys) {
+    if (g_nr_shared == VMM_SHARED_MAX || g_spaces_created)
+        return -1;
+    if (vmm_map_page(virt, phys, VMM_SHARED_FLAGS))
+        return -1;
+    g_shared[g_nr_shared].virt = align_down(virt);
+    g_shared[g_nr_shared].phys = align_down(phys);
+    g_nr_shared++;
+    return 0;
+}
+
 void vmm_switch_space(vmm_space_t space) {
     if (!space.pml4_phys)
         return;
     write_cr3(space.pml4_phys);
 }
+
+vmm_space_t vmm_current_space(void) {
+    return (vmm_space_t){.pml4_phys = read_cr3() & ~0xfffull};
+}
+
+int vmm_translate(uint64_t virt, uint64_t *phys, uint64_t *flags) {
+    uint64_t *table = pt_virt(read_cr3() & ~0xfffull);
+    // W and U must be set at every level, NX anywhere applies
+    uint64_t acc = PTE_W | PTE_U;
+    uint64_t nx = 0;
+
+    const int shifts[4] = {39, 30, 21, 12};
+    for (int level = 0; level < 4; level++) {
+        uint64_t e = table[(virt >> shifts[level]) & 0x1ff];
+        if (!(e & PTE_P))
+            return -1;
+        acc &= e;
+        nx |= e & PTE_NX;
+
+        // 1gib/2mib leaves; PS is PAT on the last level
+        if (level == 3 || ((level == 1 || level == 2) && (e & PTE_PS))) {
+            uint64_t size_mask = (1ull << shifts[level]) - 1;
+            uint64_t base = e & 0x000ffffffffff000ull & ~size_mask;
+            *phys = base | (virt & size_mask);
+            *flags = acc | nx;
+            return 0;
+        }
+        table = pt_virt(e & 0x000ffffffffff000ull);
+    }
+    return -1;
+}
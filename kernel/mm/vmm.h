@@ -38,6 +38,24 @@ int vmm_unmap_page_space(vmm_space_t space, uint64_t virt);
 int vmm_map_page_mmio(uint64_t virt, uint64_t phys, uint64_t flags);
 /* switch CR3 */
 void vmm_switch_space(vmm_space_t space);
-
-/* create a fresh address space (copies kernel mappings) */
+vmm_space_t vmm_current_space(void);
+
+/*
+ * Walk the current address space. On success stores the physical address
+ * of virt and the effective PTE_W/PTE_U/PTE_NX of the mapping.
+ */
+int vmm_translate(uint64_t virt, uint64_t *phys, uint64_t *flags);
+
+/*
+ * create a fresh address space (copies kernel mappings and the shared
+ * user pages)
+ */
 vmm_space_t vmm_create_space(void);
+
+/*
+ * Map phys at virt, user read-only and no-exec, in the current space and
+ * every space created from now on. For kernel-published data such as the
+ * clock page. Spaces are not tracked, so existing ones are not updated:
+ * fails once vmm_create_space() has been called.
+ */
+int vmm_add_shared_user_page(uint64_t virt, uint64_t phys);
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Clock page, mapped read-only at VCLOCK_USER_VA in every address space.
+ * The kernel publishes its TSC -> ns conversion here so user code can
+ * read the monotonic clock with RDTSC(P) alone:
+ *
+ *   ns = base_ns + ((tsc + tsc_offset[cpu] - base_tsc) * mult) >> shift
+ *
+ * The same clock as the kernel's timer_now_ns(). Fields are only valid
+ * between two equal, even reads of seq; when mode is VCLOCK_MODE_NONE
+ * there is no usable TSC and time has to come from the kernel.
+ *
+ * This header is shared with user space: keep it self-contained.
+ */
+
+#define VCLOCK_USER_VA 0x00007fffffffe000ull
+#define VCLOCK_MAX_CPUS 64
+
+#define VCLOCK_MODE_NONE 0
+#define VCLOCK_MODE_TSC 1
+
+typedef struct vclock_page {
+        volatile uint32_t seq; // odd while the kernel updates the page
+        uint32_t mode;
+        uint64_t base_tsc;
+        uint64_t base_ns;
+        uint32_t mult;
+        uint32_t shift;
+        /* nonzero: add tsc_offset[TSC_AUX] to every RDTSCP reading */
+        uint32_t use_offsets;
+        uint32_t reserved;
+        int64_t tsc_offset[VCLOCK_MAX_CPUS];
+} vclock_page_t;
+
+#define vclock_barrier() __asm__ volatile("" ::: "memory")
+
+static inline uint64_t vclock_rdtsc(const volatile vclock_page_t *p) {
+    uint32_t lo, hi, aux;
+    if (!p->use_offsets) {
+        __asm__ volatile("lfence\n\trdtsc" : "=a"(lo), "=d"(hi)::"memory");
+        return ((uint64_t)hi << 32) | lo;
+    }
+    __asm__ volatile("rdtscp" : "=a"(lo), "=d"(hi), "=c"(aux)::"memory");
+    return (((uint64_t)hi << 32) | lo) +
+           (uint64_t)p->tsc_offset[aux & (VCLOCK_MAX_CPUS - 1)];
+}
+
+/*
+ * Monotonic ns since boot, or 0 if the page offers no clock. The 128-bit
+ * product keeps it exact however long the base has gone unrefreshed.
+ */
+static inline uint64_t vclock_read_ns(const volatile vclock_page_t *p) {
+    uint32_t seq;
+    uint64_t ns;
+    do {
+        while ((seq = p->seq) & 1)
+            __asm__ volatile("pause" ::: "memory");
+        vclock_barrier();
+        if (p->mode != VCLOCK_MODE_TSC)
+            return 0;
+
+        uint64_t tsc = vclock_rdtsc(p);
+        uint64_t delta = tsc > p->base_tsc ? tsc - p->base_tsc : 0;
+        ns = p->base_ns +
+             (uint64_t)(((unsigned __int128)delta * p->mult) >> p->shift);
+        vclock_barrier();
+    } while (p->seq != seq);
+    return ns;
+}